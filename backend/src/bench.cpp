@@ -0,0 +1,163 @@
+#include <chrono>
+#include <cstdio>
+
+#include "corpus.hpp"
+#include "database.hpp"
+
+// A benchmark runs in batches of doubling size until one takes this long;
+// its time per call is reported.
+const double BENCH_SECONDS = 0.5;
+const size_t BENCH_DOCS = 200;
+const size_t BENCH_ENGINE_DOCS = 5000;
+const size_t BENCH_WORDS = 10000;
+const size_t BENCH_QUERY_WORDS = 3;
+// Cycling through more distinct queries than the result cache holds
+// misses it every time.
+const size_t BENCH_QUERIES = 2 * CACHE_ENTRIES;
+
+std::string filter;
+
+bool Wanted(std::string_view name) {
+  return name.find(filter) != std::string_view::npos;
+}
+
+template <class F>
+void Bench(char const* name, F&& f) {
+  if (!Wanted(name)) return;
+  for (size_t n = 1;; n *= 2) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) f(i);
+    std::chrono::duration<double> took =
+        std::chrono::steady_clock::now() - start;
+    if (took.count() < BENCH_SECONDS) continue;
+    printf("%-28s %12.1f ns/op %10zu ops\n", name, took.count() * 1e9 / n, n);
+    fflush(stdout);
+    return;
+  }
+}
+
+// Microbenchmarks over the synthetic corpus with the default seed, so runs
+// from different commits see the same input. The engine_search ones
+// search an index of the first BENCH_ENGINE_DOCS docs, built here rather
+// than read from the working directory.
+//   bench [substring]   run the benchmarks whose names contain it
+int main(int argc, char **argv) {
+  if (argc > 1) filter = argv[1];
+  Corpus corpus(LoadDictWords());
+  std::vector<std::string> texts, queries;
+  for (size_t i = 0; i < BENCH_DOCS; ++i) texts.push_back(corpus.Doc(i));
+  for (size_t i = 0; i < BENCH_QUERIES; ++i)
+    queries.push_back(corpus.Query(i, BENCH_QUERY_WORDS));
+  std::vector<std::string> words(
+      corpus.words.begin(),
+      corpus.words.begin() + std::min(BENCH_WORDS, corpus.words.size()));
+  Jieba jb;
+  auto const& jieba = jb.jieba;
+
+  // The index's term dictionary over the BENCH_WORDS most frequent words,
+  // looked up as often as the corpus uses them.
+  std::vector<std::string> sorted = words;
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+  Corpus vocabulary(words);
+  std::mt19937_64 rng(CORPUS_SEED);
+  std::vector<std::string> lookups;
+  for (size_t i = 0; i < BENCH_WORDS; ++i)
+    lookups.push_back(vocabulary.Word(rng));
+  Bench("term_dict_build", [&](size_t) {
+    TermDict dict;
+    dict.Build(sorted);
+  });
+  TermDict dict;
+  dict.Build(sorted);
+  Bench("term_dict_find",
+        [&](size_t i) { dict.Find(lookups[i % lookups.size()]); });
+  Bench("keyword_extract",
+        [&](size_t i) { jb.Keywords(texts[i % BENCH_DOCS]); });
+  std::vector<std::string> out;
+  Bench("mix_segment_cut", [&](size_t i) {
+    jieba.Cut(texts[i % BENCH_DOCS], out, true);
+  });
+  // CutHMM is the Viterbi decode plus cutting at its tags.
+  Bench("hmm_segment_viterbi", [&](size_t i) {
+    jieba.CutHMM(texts[i % BENCH_DOCS], out);
+  });
+
+  // Log calls go to /dev/null. log_enqueue times bursts that fit the
+  // ring, draining it off the clock in between, so it is what a call costs
+  // the thread making it; log_drain adds formatting and writing.
+  std::string const& query = queries[0];
+  FILE* logNull = fopen("/dev/null", "w");
+  logger.out = logNull;
+  logger.siteRate = 0;
+  Bench("log_filtered",
+        [&](size_t i) { LOG(DEBUG, "search: {} {}", query, i); });
+  if (Wanted("log_enqueue")) {
+    std::chrono::duration<double> took{0};
+    size_t n = 0;
+    for (; took.count() < BENCH_SECONDS; n += LOG_RING) {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < LOG_RING; ++i)
+        LOG(INFO, "search: {} {}", query, n + i);
+      took += std::chrono::steady_clock::now() - start;
+      logger.Flush();
+    }
+    printf("%-28s %12.1f ns/op %10zu ops\n", "log_enqueue",
+           took.count() * 1e9 / n, n);
+  }
+  Bench("log_drain", [&](size_t i) {
+    LOG(INFO, "search: {} {}", query, i);
+    if (i % LOG_RING == LOG_RING - 1) logger.Flush();
+  });
+  logger.siteRate = 1;
+  Bench("log_skipped",
+        [&](size_t i) { LOG(INFO, "search: {} {}", query, i); });
+  logger.siteRate = LOG_SITE_RATE;
+  // The drainer only writes with the logger's mutex held, so once the
+  // stream is swapped under it nothing can still be writing to logNull.
+  logger.Flush();
+  {
+    std::lock_guard<std::mutex> lock(logger.mutex);
+    logger.out = stderr;
+  }
+  fclose(logNull);
+  // What the server did before: a synchronous write to stderr.
+  std::ofstream devNull("/dev/null");
+  auto err = std::cerr.rdbuf(devNull.rdbuf());
+  Bench("cerr_write",
+        [&](size_t i) { std::cerr << query << ' ' << i << '\n'; });
+  std::cerr.rdbuf(err);
+
+  if (!Wanted("engine_search_cached") && !Wanted("engine_search_bm25") &&
+      !Wanted("engine_search_untimed") &&
+      !Wanted("engine_search_cached_untimed"))
+    return 0;
+  InvertedIndex index;
+  DocTable docs;
+  BuildIndex(index, docs, [&](auto&& add) {
+    for (size_t i = 0; i < BENCH_ENGINE_DOCS; ++i) {
+      auto text = corpus.Doc(i);
+      auto kws = jb.Keywords(text);
+      ToCharPositions(text, kws);
+      double w = sqrt(Engine::GetNorm(kws));
+      add({std::move(text), w, (int64_t)i + 1}, ToTerms(kws));
+    }
+  });
+  Engine db(std::move(index), std::move(docs));
+  Bench("engine_search",
+        [&](size_t i) { db.Search(queries[i % BENCH_QUERIES]); });
+  Bench("engine_search_bm25", [&](size_t i) {
+    db.Search(queries[i % BENCH_QUERIES], Engine::Mode::WAND,
+              Engine::Scoring::BM25);
+  });
+  Bench("engine_search_cached",
+        [&](size_t i) { db.Search(queries[i % BENCH_DOCS]); });
+  // The same with phase timing off, for what the metrics cost.
+  metrics.timing = false;
+  Bench("engine_search_untimed",
+        [&](size_t i) { db.Search(queries[i % BENCH_QUERIES]); });
+  Bench("engine_search_cached_untimed",
+        [&](size_t i) { db.Search(queries[i % BENCH_DOCS]); });
+  metrics.timing = true;
+  return 0;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+const size_t CACHE_SHARDS = 16;
+const size_t CACHE_ENTRIES = 4096;
+
+// LRU cache split into independently locked shards by key hash. Entries
+// carry the index generation they were computed at and only answer
+// lookups made at that same generation; older ones are dropped on sight.
+template <class V>
+struct ShardedCache {
+  struct Entry {
+    std::string key;
+    uint64_t generation;
+    V value;
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru;  // most recently used first
+    std::unordered_map<std::string_view, typename std::list<Entry>::iterator>
+        index;
+  };
+
+  std::vector<Shard> shards;
+  size_t perShard;
+  std::atomic<uint64_t> hits{0}, misses{0}, evictions{0}, invalidations{0};
+
+  explicit ShardedCache(size_t capacity = CACHE_ENTRIES)
+      : shards(CACHE_SHARDS),
+        perShard(std::max<size_t>(1, capacity / CACHE_SHARDS)) {}
+
+  std::optional<V> Get(std::string const& key, uint64_t generation) {
+    auto& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end() && it->second->generation != generation) {
+      shard.lru.erase(it->second);
+      shard.index.erase(it);
+      ++invalidations;
+      it = shard.index.end();
+    }
+    if (it == shard.index.end()) {
+      ++misses;
+      return std::nullopt;
+    }
+    ++hits;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->value;
+  }
+
+  void Put(std::string key, uint64_t generation, V value) {
+    auto& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      if (it->second->generation > generation) return;
+      shard.lru.erase(it->second);
+      shard.index.erase(it);
+    }
+    shard.lru.push_front({std::move(key), generation, std::move(value)});
+    shard.index.emplace(shard.lru.front().key, shard.lru.begin());
+    if (shard.lru.size() > perShard) {
+      shard.index.erase(shard.lru.back().key);
+      shard.lru.pop_back();
+      ++evictions;
+    }
+  }
+
+  size_t size() {
+    size_t n = 0;
+    for (auto& shard : shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      n += shard.lru.size();
+    }
+    return n;
+  }
+
+ private:
+  Shard& ShardOf(std::string const& key) {
+    return shards[std::hash<std::string>()(key) % shards.size()];
+  }
+};
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../third_party/httplib.h"
+#include "database.hpp"
+#include "pool.hpp"
+
+// Scatter-gather across processes. Each shard is an ordinary server
+// started with --shard s/N, holding the rows of db.db whose rowid is s
+// modulo N, so one checkout can serve them all; a coordinator segments the
+// query once, sends the keywords and phrases to every shard and merges
+// their top-k. The coordinator's doc IDs interleave the shards' own: doc i
+// of shard s is doc i * shards + s to its clients, which is not the ID an
+// unsharded server gives the same row.
+const char* const SHARD_SEARCH_PATH = "/shard/search";
+const int SHARD_TIMEOUT_MS = 500;
+// Calls to one shard in flight at once, each on a kept-alive connection.
+const size_t SHARD_CONNECTIONS = 8;
+
+// The internal protocol: varints, raw doubles and length-prefixed strings,
+// read back in the order they were written.
+struct WireWriter {
+  std::string out;
+
+  void Varint(uint64_t v) {
+    for (; v >= 0x80; v >>= 7) out += (char)(v | 0x80);
+    out += (char)v;
+  }
+  void Double(double v) { out.append((char const*)&v, sizeof v); }
+  void String(std::string_view s) {
+    Varint(s.size());
+    out.append(s);
+  }
+};
+
+// Throws on input that ends early, so a bad request cannot read past it.
+struct WireReader {
+  std::string_view in;
+  size_t at = 0;
+
+  uint64_t Varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t b = Take(1)[0];
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) return v;
+    }
+    throw std::runtime_error("bad varint");
+  }
+  double Double() {
+    double v;
+    memcpy(&v, Take(sizeof v).data(), sizeof v);
+    return v;
+  }
+  std::string_view String() { return Take(Varint()); }
+  // A count of items, each taking at least one more byte.
+  size_t Count() {
+    auto n = Varint();
+    if (n > in.size() - at) throw std::runtime_error("bad count");
+    return n;
+  }
+  bool Done() const { return at == in.size(); }
+
+ private:
+  std::string_view Take(size_t n) {
+    if (n > in.size() - at) throw std::runtime_error("truncated message");
+    auto s = in.substr(at, n);
+    at += n;
+    return s;
+  }
+};
+
+// What the coordinator sends: the mode, the scoring, the snippet length
+// (0 for whole contents), the keywords with their query counts, the
+// phrases, and the required and excluded clauses.
+inline std::string EncodeShardQuery(AnalyzedQuery const& q, Engine::Mode mode,
+                                    Engine::Scoring scoring,
+                                    size_t snippetLength) {
+  WireWriter w;
+  w.Varint((uint64_t)mode);
+  w.Varint((uint64_t)scoring);
+  w.Varint(snippetLength);
+  w.Varint(q.kws.size());
+  for (auto const& kw : q.kws) {
+    w.String(kw.word);
+    w.Double(kw.weight);
+    w.Varint(Engine::QueryCount(kw));
+  }
+  w.Varint(q.phrases.size());
+  for (auto const& p : q.phrases) {
+    w.Varint(p.length);
+    w.Varint(p.slop + 1);
+    w.Varint(p.words.size());
+    for (size_t i = 0; i < p.words.size(); ++i) {
+      w.String(p.words[i]);
+      w.Varint(p.lengths[i]);
+    }
+    w.Varint(p.slots.size());
+    for (auto [word, offset] : p.slots) {
+      w.Varint(word);
+      w.Varint(offset);
+    }
+  }
+  for (auto const* clauses : {&q.required, &q.excluded}) {
+    w.Varint(clauses->size());
+    for (auto const& clause : *clauses) {
+      w.Varint(clause.size());
+      for (auto const& word : clause) w.String(word);
+    }
+  }
+  return std::move(w.out);
+}
+
+// Only the count of each keyword's offsets comes across, as that many
+// zeros.
+inline void DecodeShardQuery(std::string_view body, AnalyzedQuery& q,
+                             Engine::Mode& mode, Engine::Scoring& scoring,
+                             size_t& snippetLength) {
+  WireReader r{body};
+  auto m = r.Varint();
+  if (m > (uint64_t)Engine::Mode::ANYTIME) throw std::runtime_error("bad mode");
+  mode = (Engine::Mode)m;
+  scoring = r.Varint() ? Engine::Scoring::BM25 : Engine::Scoring::COSINE;
+  snippetLength = r.Varint();
+  q.kws.resize(r.Count());
+  for (auto& kw : q.kws) {
+    kw.word = r.String();
+    kw.weight = r.Double();
+    kw.offsets.resize(r.Count());
+  }
+  q.phrases.resize(r.Count());
+  for (auto& p : q.phrases) {
+    p.length = r.Varint();
+    p.slop = (int)r.Varint() - 1;
+    p.words.resize(r.Count());
+    p.lengths.resize(p.words.size());
+    for (size_t i = 0; i < p.words.size(); ++i) {
+      p.words[i] = r.String();
+      p.lengths[i] = r.Varint();
+    }
+    p.slots.resize(r.Count());
+    for (auto& [word, offset] : p.slots) {
+      word = r.Varint();
+      offset = r.Varint();
+      if (word >= p.words.size()) throw std::runtime_error("bad phrase");
+    }
+  }
+  for (auto* clauses : {&q.required, &q.excluded}) {
+    clauses->resize(r.Count());
+    for (auto& clause : *clauses) {
+      clause.resize(r.Count());
+      if (clause.empty()) throw std::runtime_error("empty clause");
+      for (auto& word : clause) word = r.String();
+    }
+  }
+  if (!r.Done()) throw std::runtime_error("trailing bytes");
+}
+
+// A shard's hit as the coordinator gets it.
+struct ShardHit {
+  Hit hit;
+  std::string text;
+  std::vector<std::pair<size_t, size_t>> highlights;
+};
+
+// Answers a coordinator's query with this shard's best hits, each with
+// its score and its snippet or content. The keywords are not expanded
+// fuzzily: each shard would expand them against its own vocabulary, and
+// the scores the coordinator merges would not be for the same query.
+inline std::string ServeShardQuery(Engine& db, std::string_view body) {
+  AnalyzedQuery q;
+  Engine::Mode mode;
+  Engine::Scoring scoring;
+  size_t snippetLength;
+  DecodeShardQuery(body, q, mode, scoring, snippetLength);
+  auto hits = db.Hits(q, mode, scoring);
+  WireWriter w;
+  w.Varint(hits.size());
+  for (auto [id, score] : hits) {
+    w.Varint(id);
+    w.Double(score);
+    if (!snippetLength) {
+      w.String(db.docs.Content(id));
+      w.Varint(0);
+      continue;
+    }
+    auto snippet = MakeSnippet(db.docs.Content(id), q.kws, snippetLength);
+    w.String(snippet.text);
+    w.Varint(snippet.highlights.size());
+    for (auto [begin, end] : snippet.highlights) {
+      w.Varint(begin);
+      w.Varint(end);
+    }
+  }
+  return std::move(w.out);
+}
+
+inline std::vector<ShardHit> DecodeShardHits(std::string_view body) {
+  WireReader r{body};
+  std::vector<ShardHit> hits(r.Count());
+  for (auto& h : hits) {
+    h.hit.id = r.Varint();
+    h.hit.score = r.Double();
+    h.text = r.String();
+    h.highlights.resize(r.Count());
+    for (auto& [begin, end] : h.highlights) {
+      begin = r.Varint();
+      end = r.Varint();
+    }
+  }
+  return hits;
+}
+
+// Fans queries out to the shard servers at `shards` ("host:port" each).
+// A shard that fails or has not answered `timeout` after the query went
+// out is left out, and the response says so; its call finishes on the
+// pool unwaited for.
+struct Coordinator {
+  // Idle kept-alive connections to a shard.
+  struct Connections {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<httplib::Client>> idle;
+  };
+
+  Jieba jb;
+  std::vector<std::string> shards;
+  std::chrono::milliseconds timeout{SHARD_TIMEOUT_MS};
+  std::vector<std::unique_ptr<Connections>> connections;
+  WorkStealingPool calls;
+
+  explicit Coordinator(std::vector<std::string> shards)
+      : shards(std::move(shards)),
+        calls(this->shards.size() * SHARD_CONNECTIONS) {
+    for (size_t s = 0; s < this->shards.size(); ++s)
+      connections.push_back(std::make_unique<Connections>());
+  }
+
+  // Runs call(client) on an idle connection to shard s, or a new one, and
+  // keeps the connection for the next call.
+  template <class F>
+  auto WithClient(size_t s, F&& call) {
+    auto& pool = *connections[s];
+    std::unique_ptr<httplib::Client> cli;
+    {
+      std::lock_guard<std::mutex> lock(pool.mutex);
+      if (!pool.idle.empty()) {
+        cli = std::move(pool.idle.back());
+        pool.idle.pop_back();
+      }
+    }
+    if (!cli) {
+      cli = std::make_unique<httplib::Client>(shards[s].c_str());
+      cli->set_keep_alive(true);
+      cli->set_connection_timeout(timeout);
+      cli->set_read_timeout(timeout);
+    }
+    auto res = call(*cli);
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.idle.push_back(std::move(cli));
+    return res;
+  }
+
+  JsonWriter Search(std::string const& sentence,
+                    Engine::Mode mode = Engine::Mode::WAND,
+                    Engine::Scoring scoring = Engine::Scoring::COSINE,
+                    size_t snippetLength = 0) {
+    auto q = AnalyzeQuery(jb, sentence);
+    auto body = std::make_shared<std::string const>(
+        EncodeShardQuery(q, mode, scoring, snippetLength));
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::vector<std::future<std::vector<ShardHit>>> replies;
+    for (size_t s = 0; s < shards.size(); ++s) {
+      auto reply = std::make_shared<std::promise<std::vector<ShardHit>>>();
+      replies.push_back(reply->get_future());
+      calls.Submit([this, s, body, reply] {
+        try {
+          auto res = WithClient(s, [&](httplib::Client& cli) {
+            return cli.Post(SHARD_SEARCH_PATH, *body,
+                            "application/octet-stream");
+          });
+          if (!res || res->status != 200)
+            throw std::runtime_error("shard " + shards[s] +
+                                     " did not answer");
+          reply->set_value(DecodeShardHits(res->body));
+        } catch (...) {
+          reply->set_exception(std::current_exception());
+        }
+      });
+    }
+
+    std::vector<ShardHit> all;
+    std::vector<std::string const*> missing;
+    for (size_t s = 0; s < shards.size(); ++s) {
+      try {
+        if (replies[s].wait_until(deadline) != std::future_status::ready)
+          throw std::runtime_error("shard " + shards[s] + " timed out");
+        for (auto& h : replies[s].get()) {
+          h.hit.id = h.hit.id * shards.size() + s;
+          all.push_back(std::move(h));
+        }
+      } catch (std::exception const& e) {
+        LOG(WARN, "{}", e.what());
+        missing.push_back(&shards[s]);
+      }
+    }
+    size_t k = std::min(RESULTS, all.size());
+    std::partial_sort(all.begin(), all.begin() + k, all.end(),
+                      [](auto& a, auto& b) { return Better(a.hit, b.hit); });
+    all.resize(k);
+
+    JsonWriter w;
+    w.Open('{').Key("keywords");
+    Engine::WriteKeywords(w, q.kws);
+    Engine::WriteIgnored(w, q.ignored);
+    // No hits is null, as the frontend expects.
+    w.Key("results");
+    if (all.empty())
+      w.Null();
+    else
+      w.Open('[');
+    for (auto& h : all) {
+      w.Open('{').Key("id").Number(h.hit.id);
+      w.Key("norm").Number(h.hit.score);
+      w.Key(snippetLength ? "snippet" : "content").String(h.text);
+      if (snippetLength)
+        Engine::WriteHighlights(w.Key("highlights"), h.highlights);
+      w.Close('}');
+    }
+    if (!all.empty()) w.Close(']');
+    w.Key("partial").Bool(!missing.empty());
+    w.Key("missing").Open('[');
+    for (auto shard : missing) w.String(*shard);
+    w.Close(']').Close('}');
+    return w;
+  }
+
+  std::optional<JsonWriter> Document(size_t id) {
+    size_t s = id % shards.size();
+    auto res = WithClient(s, [&](httplib::Client& cli) {
+      return cli.Get(("/doc?id=" + std::to_string(id / shards.size())).c_str());
+    });
+    if (!res || res->status != 200) return std::nullopt;
+    auto j = Json::parse(res->body, nullptr, false);
+    if (!j.is_object() || !j["content"].is_string()) return std::nullopt;
+    JsonWriter w;
+    w.Open('{').Key("id").Number(id);
+    w.Key("content").String(j["content"].get_ref<std::string const&>());
+    w.Close('}');
+    return w;
+  }
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+inline void PutVarint(std::vector<uint8_t>& out, uint32_t v) {
+  while (v >= 0x80) {
+    out.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+inline uint32_t GetVarint(uint8_t const*& p) {
+  uint32_t v = *p & 0x7f;
+  for (int shift = 7; *p++ & 0x80; shift += 7)
+    v |= (uint32_t)(*p & 0x7f) << shift;
+  return v;
+}
+
+// 64-bit checksum taking eight bytes per step, for snapshot sections.
+inline uint64_t Checksum(void const* data, size_t size) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+  auto p = (uint8_t const*)data;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    h = (h ^ word) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  for (; size; --size) h = (h ^ *p++) * 0x100000001b3ull;
+  return h ^ h >> 29;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "segmentation.hpp"
+
+// Synthetic corpora for benchmarks. Words of the jieba dictionary are
+// ranked by their dictionary frequency and drawn with probability
+// proportional to 1 / rank^CORPUS_ZIPF. Doc i depends only on the seed and
+// i, and the generator and sampler are spelled out here rather than taken
+// from <random>'s distributions, whose output differs between standard
+// libraries, so a seed gives the same corpus everywhere.
+const double CORPUS_ZIPF = 1.0;
+const uint64_t CORPUS_SEED = 1;
+const size_t CORPUS_MIN_WORDS = 50;
+const size_t CORPUS_MAX_WORDS = 500;
+const size_t CORPUS_CLAUSE_WORDS = 12;  // words between punctuation, on average
+
+// Dictionary words, most frequent first.
+inline std::vector<std::string> LoadDictWords(
+    std::string const& path = DICT_PATH) {
+  std::ifstream in(path);
+  if (!in) throw std::runtime_error("cannot open " + path);
+  std::vector<std::pair<double, std::string>> entries;
+  std::string line, word;
+  double freq;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    if (fields >> word >> freq) entries.push_back({freq, std::move(word)});
+  }
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](auto& a, auto& b) { return a.first > b.first; });
+  std::vector<std::string> words;
+  for (auto& [_, w] : entries) words.push_back(std::move(w));
+  return words;
+}
+
+struct Corpus {
+  std::vector<std::string> words;
+  std::vector<double> cdf;  // cdf[r]: weight of ranks 0..r
+  uint64_t seed;
+
+  explicit Corpus(std::vector<std::string> words, uint64_t seed = CORPUS_SEED)
+      : words(std::move(words)), seed(seed) {
+    double total = 0;
+    for (size_t r = 0; r < this->words.size(); ++r)
+      cdf.push_back(total += std::pow(r + 1, -CORPUS_ZIPF));
+  }
+
+  static double Uniform(std::mt19937_64& rng) {
+    return (rng() >> 11) * 0x1.0p-53;
+  }
+  std::string const& Word(std::mt19937_64& rng) const {
+    double u = Uniform(rng) * cdf.back();
+    auto r = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    return words[std::min<size_t>(r, words.size() - 1)];
+  }
+
+  std::string Doc(uint64_t i) const {
+    std::mt19937_64 rng(seed * 0x9E3779B97F4A7C15ull + i);
+    size_t n = CORPUS_MIN_WORDS +
+               rng() % (CORPUS_MAX_WORDS - CORPUS_MIN_WORDS + 1);
+    std::string text;
+    for (size_t w = 1; w <= n; ++w) {
+      text += Word(rng);
+      if (w == n || rng() % (CORPUS_CLAUSE_WORDS * 2) == 0)
+        text += w == n || rng() % 2 ? "。" : "，";
+    }
+    return text;
+  }
+
+  // A query of `n` words, numbered apart from the docs.
+  std::string Query(uint64_t i, size_t n) const {
+    std::mt19937_64 rng(~(seed * 0x9E3779B97F4A7C15ull + i));
+    std::string text;
+    for (size_t w = 0; w < n; ++w) text += Word(rng);
+    return text;
+  }
+};
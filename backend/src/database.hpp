@@ -1,160 +1,1240 @@
+#pragma once
+
 #include <cctype>
+#include <condition_variable>
 #include <filesystem>
-#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <random>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 #include "../third_party/json.hpp"
 #include "../third_party/sqlite_orm.h"
+#include "cache.hpp"
+#include "fuzzy.hpp"
+#include "index.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "pool.hpp"
+#include "query.hpp"
+#include "response.hpp"
+#include "ingest.hpp"
+#include "ranking.hpp"
+#include "segment.hpp"
 #include "segmentation.hpp"
+#include "snapshot.hpp"
+#include "snippet.hpp"
+#include "suggest.hpp"
 
-using ArticleID = uint32_t;
+using Json = nlohmann::json;
 
-const int SPLIT_STEP = 256;
+struct ArtRec {
+  std::string content;
+  double weight;
+  std::string keywords;
+};
 
-struct Trie {
-  struct Node {
-    Node* son[SPLIT_STEP];
-    std::list<std::pair<size_t, double>> arts;
-    Node() : son{} {}
-  } * root;
+auto database = sqlite_orm::make_storage(
+    "db.db", sqlite_orm::make_table(
+                 "ARTS", sqlite_orm::make_column("CONTENT", &ArtRec::content),
+                 sqlite_orm::make_column("WEIGHT", &ArtRec::weight),
+                 sqlite_orm::make_column("KEYWORDS", &ArtRec::keywords)));
 
-  Trie() : root(new Node) {}
+const char* const SNAPSHOT_PATH = "index.petal";
+const double CACHE_WEIGHT_SCALE = 1000;
+const size_t SHARD_MIN_DOCS = 4096;
+const size_t RESULTS = 20;
+const size_t MAX_BATCH = 1000;
+const size_t ANYTIME_POSTINGS = 1 << 20;
+const long ANYTIME_MICROS = 2000;
+const auto SUGGEST_REBUILD = std::chrono::seconds(10);
 
-  ~Trie() {
-    std::function<void(Node*)> Free = [&](Node* x) {
-      for (int i = 0; i < SPLIT_STEP; ++i)
-        if (x->son[i]) Free(x->son[i]);
-      Free(x);
-    };
-    Free(root);
+// The rows one server of a cluster holds: those whose rowid is `shard`
+// modulo `shards`. The shards share db.db and the dictionaries, and each
+// maps a snapshot of its own, so they can all run from one checkout.
+struct RowShard {
+  int64_t shard = 0, shards = 1;
+
+  bool Holds(int64_t rowid) const { return rowid % shards == shard; }
+  std::string SnapshotPath() const {
+    if (shards == 1) return SNAPSHOT_PATH;
+    return "index." + std::to_string(shard) + "-of-" +
+           std::to_string(shards) + ".petal";
   }
+  // From "s/N".
+  static RowShard Parse(std::string const& s) {
+    RowShard part;
+    char* end;
+    part.shard = std::strtoll(s.c_str(), &end, 10);
+    if (*end != '/') throw std::runtime_error("expected s/N, not " + s);
+    part.shards = std::strtoll(end + 1, &end, 10);
+    if (*end || part.shards < 1 || part.shard < 0 || part.shard >= part.shards)
+      throw std::runtime_error("expected s/N with s < N, not " + s);
+    return part;
+  }
+};
 
-  void Insert(std::string word, std::pair<size_t, double> art) {
-    Node* pos = root;
-    for (int i = 0; i < word.length(); ++i) {
-      assert((uint8_t)word[i] == word[i]);
-      uint8_t ch = word[i];
-      pos = pos->son[ch] ? pos->son[ch] : (pos->son[ch] = new Node);
+// Keywords as stored in the KEYWORDS column, with their character
+// positions as offsets. Rows stored before positions were kept get them by
+// looking the words up in the content.
+inline KeywordList KeywordsFromJson(std::string const& keywords,
+                                    std::string_view content) {
+  KeywordList kws;
+  bool stored = true;
+  for (auto const& jkw : Json::parse(keywords)) {
+    auto& kw = kws.emplace_back();
+    kw.word = jkw["word"];
+    kw.weight = jkw["weight"];
+    if (jkw.contains("positions")) {
+      jkw["positions"].get_to(kw.offsets);
+      continue;
     }
-    pos->arts.push_back(art);
+    stored = false;
+    for (size_t i = content.find(kw.word); i != std::string_view::npos;
+         i = content.find(kw.word, i + kw.word.size()))
+      kw.offsets.push_back(i);
   }
+  if (!stored) ToCharPositions(content, kws);
+  return kws;
+}
 
-  std::list<std::pair<size_t, double>> const* Query(std::string word) const {
-    Node* pos = root;
-    for (int i = 0; i < word.length(); ++i) {
-      uint8_t ch = word[i];
-      if (pos->son[ch])
-        pos = pos->son[ch];
-      else
-        return nullptr;
+inline std::vector<MemTerm> ToTerms(KeywordList const& kws) {
+  std::vector<MemTerm> terms;
+  for (auto const& kw : kws)
+    terms.push_back(
+        {kw.word, kw.weight, {kw.offsets.begin(), kw.offsets.end()}});
+  std::sort(terms.begin(), terms.end());
+  return terms;
+}
+
+// Builds the index over the articles each(add) hands to add(art, terms),
+// numbered in that order.
+template <class F>
+void BuildIndex(InvertedIndex& index, DocTable& docs, F&& each) {
+  IndexBuilder builder;
+  docs = {};
+  each([&](DocTable::Article art, std::vector<MemTerm> terms) {
+    for (auto& t : terms)
+      builder.Insert(t.word, {docs.size(), t.weight}, std::move(t.positions));
+    docs.Add(std::move(art));
+  });
+  docs.Freeze();
+  Bm25 bm25{builder.AverageLength()};
+  index = builder.Build([&](ArticleID i) { return docs.Norm(i); }, bm25);
+}
+
+// Reads the shard's articles out of SQLite and builds the index over them.
+inline void LoadDatabase(InvertedIndex& index, DocTable& docs,
+                         RowShard const& part = {}) {
+  using namespace sqlite_orm;
+  auto artRecs = database.select(
+      columns(rowid(), &ArtRec::content, &ArtRec::weight, &ArtRec::keywords),
+      where(is_equal(mod(rowid(), part.shards), part.shard)),
+      order_by(rowid()));
+  BuildIndex(index, docs, [&](auto&& add) {
+    for (auto& [id, content, weight, keywords] : artRecs) {
+      auto terms = ToTerms(KeywordsFromJson(keywords, content));
+      add({std::move(content), weight, id}, std::move(terms));
     }
-    return &pos->arts;
+  });
+}
+
+// A query segmented into weighted keywords, its quoted phrases, and the
+// keywords of each required and excluded word. A doc must hold every
+// keyword of each required clause, and is dropped if it holds every
+// keyword of some excluded clause. Operator words with no keywords, such
+// as stop words, cannot be matched and are reported back as ignored.
+struct AnalyzedQuery {
+  using Clause = std::vector<std::string>;
+  KeywordList kws;
+  std::vector<Phrase> phrases;
+  std::vector<Clause> required, excluded;
+  std::vector<std::string> ignored;  // "+word" or "-word"
+
+  // Whether only the keywords matter: any doc holding one is a candidate.
+  bool Plain() const {
+    return phrases.empty() && required.empty() && excluded.empty();
   }
 };
 
-using Json = nlohmann::json;
+inline AnalyzedQuery AnalyzeQuery(Jieba const& jb, std::string_view sentence) {
+  auto query = ParseQuery(sentence);
+  AnalyzedQuery q{jb.Keywords(query.text), {}, {}, {}, {}};
+  for (auto const& [text, slop] : query.phrases) {
+    auto pkws = jb.Keywords(text);
+    ToCharPositions(text, pkws);
+    if (!pkws.empty()) q.phrases.emplace_back(pkws, text, slop);
+  }
+  auto clauses = [&](char op, std::vector<std::string> const& words,
+                     auto& out) {
+    for (auto const& word : words) {
+      AnalyzedQuery::Clause clause;
+      for (auto const& kw : jb.Keywords(word)) clause.push_back(kw.word);
+      if (clause.empty())
+        q.ignored.push_back(op + word);
+      else
+        out.push_back(std::move(clause));
+    }
+  };
+  clauses('+', query.required, q.required);
+  clauses('-', query.excluded, q.excluded);
+  return q;
+}
 
-struct ArtRec {
-  std::string content;
-  double weight;
-  std::string keywords;
+// What a search sees: the sealed segments in doc order, the docs added
+// since the last seal, and how many docs existed when it was published.
+// Never modified once published; writers publish a new one instead.
+struct IndexState {
+  std::vector<SegmentPtr> segments;
+  std::vector<MemDocPtr> pending;
+  size_t docs = 0;
+  uint64_t generation = 0;
 };
-
-auto database = sqlite_orm::make_storage(
-    "db.db", sqlite_orm::make_table(
-                 "ARTS", sqlite_orm::make_column("CONTENT", &ArtRec::content),
-                 sqlite_orm::make_column("WEIGHT", &ArtRec::weight),
-                 sqlite_orm::make_column("KEYWORDS", &ArtRec::keywords)));
+using StatePtr = std::shared_ptr<IndexState const>;
 
 struct Engine {
-  struct Article {
-    std::string content;
-    double w;
-    bool deleted;
-  };
-
-  Trie tr;
+  DocTable docs;
   Jieba jb;
-  std::vector<Article> arts;
-  int deletedCount;
+  RowShard part;
 
-  Engine() { Load(); }
+  // Readers grab the current state with Snapshot() and never block.
+  // Writers (adds, deletes, the merger's swaps) serialize on writeMutex
+  // and publish a new state atomically.
+  StatePtr state = std::make_shared<IndexState>();
+  // Set from the base index; segments sealed on top of it reuse its
+  // average doc length so their impacts stay comparable.
+  Bm25 bm25;
+  ShardedCache<std::vector<Hit>> cache;
+  // WAND queries split the doc IDs into up to `shards` ranges scored in
+  // parallel on the pool, each into its own top-k.
+  WorkStealingPool pool;
+  size_t shards = pool.size();
+  AnytimeBudget anytime{ANYTIME_POSTINGS,
+                        std::chrono::microseconds(ANYTIME_MICROS)};
+  // One set of anytime accumulators per pool thread at most.
+  AccumulatorPool accumulators{pool.size()};
+  // Rebuilt by the merger when it is idle and the segments changed, at
+  // most once every SUGGEST_REBUILD; null until the first build.
+  std::shared_ptr<Suggester const> suggester;
+  bool fuzzy = true;
+  std::mutex writeMutex;
+  std::condition_variable mergeCv;
+  bool stopping = false;
+  std::thread merger;
+
+  explicit Engine(RowShard part = {}) : part(part) {
+    if (!std::filesystem::exists(part.SnapshotPath()) || !Map()) Load();
+    merger = std::thread([this] { MergeLoop(); });
+  }
+  // Serves an index built elsewhere, with no snapshot or db.db behind it.
+  Engine(InvertedIndex index, DocTable docs) : docs(std::move(docs)) {
+    Reset(std::move(index));
+    merger = std::thread([this] { MergeLoop(); });
+  }
+
+  // Starts from the snapshot plus whatever was added since it was written;
+  // false if it cannot be used, e.g. written by an older indexer.
+  bool Map() {
+    InvertedIndex index;
+    try {
+      ReadSnapshot(part.SnapshotPath(), index, docs);
+    } catch (std::exception const& e) {
+      LOG(WARN, "{}, loading from the database", e.what());
+      return false;
+    }
+    LOG(INFO, "Mapped {}: {} docs, {} terms", part.SnapshotPath(),
+        docs.size(), index.dict.size);
+    Reset(std::move(index));
+    CatchUp();
+    return true;
+  }
+
+  ~Engine() {
+    {
+      std::lock_guard<std::mutex> lock(writeMutex);
+      stopping = true;
+    }
+    mergeCv.notify_all();
+    merger.join();
+  }
 
   void Load() {
-    auto artRecs = database.get_all<ArtRec>();
+    InvertedIndex index;
+    LoadDatabase(index, docs, part);
+    LOG(INFO,
+        "Index: {} terms, dictionary {} bytes (256-way trie: {} bytes), "
+        "total {} bytes, {} bytes/posting",
+        index.dict.size, index.dict.MemoryUsage(),
+        index.dict.TrieFootprint(), index.MemoryUsage(),
+        (double)index.postings.MemoryUsage() /
+            std::max<size_t>(1, index.postings.Postings()));
+    Reset(std::move(index));
+  }
+
+  StatePtr Snapshot() const { return std::atomic_load(&state); }
+
+  // Called with writeMutex held, or before any other thread runs.
+  void Publish(std::shared_ptr<IndexState> next) {
+    next->docs = docs.size();
+    next->generation = state->generation + 1;
+    std::atomic_store(&state, StatePtr(std::move(next)));
+  }
+
+  // Starts over from one segment over the frozen docs.
+  void Reset(InvertedIndex index) {
+    auto seg = std::make_shared<Segment>();
+    seg->first = 0;
+    seg->end = docs.Frozen();
+    seg->index = std::move(index);
+    bm25 = seg->index.bm25;
+    seg->norms = docs.norms;
+    auto next = std::make_shared<IndexState>();
+    next->segments = {seg};
+    Publish(std::move(next));
+  }
 
-    for (auto i : artRecs) {
-      std::cerr << "Loading...\n";
-      arts.push_back({i.content, i.weight});
-      Json jkws = Json::parse((std::string)i.keywords);
-      for (auto kw : jkws)
-        tr.Insert(kw["word"], {arts.size() - 1, kw["weight"]});
+  // Indexes rows added to SQLite after the snapshot was written.
+  void CatchUp() {
+    using namespace sqlite_orm;
+    // The indexer may have reordered the frozen docs.
+    int64_t last = 0;
+    for (size_t i = 0; i < docs.size(); ++i)
+      last = std::max(last, docs.RowID(i));
+    auto artRecs = database.select(
+        columns(rowid(), &ArtRec::content, &ArtRec::weight, &ArtRec::keywords),
+        where(c(rowid()) > last &&
+              is_equal(mod(rowid(), part.shards), part.shard)),
+        order_by(rowid()));
+    for (auto& [id, content, weight, keywords] : artRecs) {
+      MemDoc doc{0, weight, ToTerms(KeywordsFromJson(keywords, content))};
+      Index({std::move(content), weight, id}, std::move(doc));
     }
   }
 
-  double GetNorm(KeywordList const& kws) {
+  // Appends the article and makes it searchable right away; every
+  // SEAL_DOCS docs the pending ones are sealed into a segment for the
+  // merger to pick up.
+  void Index(DocTable::Article art, MemDoc doc) {
+    std::sort(doc.terms.begin(), doc.terms.end());
+    metrics.ingested.Add(1);
+    std::lock_guard<std::mutex> lock(writeMutex);
+    doc.id = docs.size();
+    doc.length = DocLength(doc.terms);
+    docs.Add(std::move(art));
+    auto next = std::make_shared<IndexState>(*state);
+    next->pending.push_back(std::make_shared<MemDoc const>(std::move(doc)));
+    if (next->pending.size() >= SEAL_DOCS) {
+      next->segments.push_back(SealSegment(next->pending, bm25));
+      next->pending.clear();
+      mergeCv.notify_one();
+    }
+    Publish(std::move(next));
+  }
+
+  // Background merging and compaction: MERGE_FACTOR adjacent segments of
+  // a tier become one segment of the next tier, and segments with enough
+  // new deletions are rewritten without their postings. The new segment is
+  // built without holding the lock from a copy of the deleted bits, and
+  // swapped in if the segment list was not reset meanwhile. With nothing
+  // to merge, it brings the suggester up to date.
+  void MergeLoop() {
+    std::unique_lock<std::mutex> lock(writeMutex);
+    auto deadCount = [&](ArticleID first, ArticleID end) {
+      return docs.deleted.Count(first, end);
+    };
+    std::vector<SegmentPtr> suggested;
+    auto nextSuggest = std::chrono::steady_clock::now();
+    while (!stopping) {
+      auto [begin, count] = PickMerge(state->segments, deadCount);
+      if (!count && suggested != state->segments) {
+        if (std::chrono::steady_clock::now() < nextSuggest) {
+          mergeCv.wait_until(lock, nextSuggest);
+          continue;
+        }
+        suggested = state->segments;
+        lock.unlock();
+        std::atomic_store(&suggester, BuildSuggester(suggested));
+        lock.lock();
+        nextSuggest = std::chrono::steady_clock::now() + SUGGEST_REBUILD;
+        continue;
+      }
+      if (!count) {
+        mergeCv.wait(lock);
+        continue;
+      }
+      std::vector<SegmentPtr> run(state->segments.begin() + begin,
+                                  state->segments.begin() + begin + count);
+      std::vector<bool> dead;
+      for (ArticleID i = run.front()->first; i < run.back()->end; ++i)
+        dead.push_back(docs.Deleted(i));
+      lock.unlock();
+      auto merged = MergeSegments(run, dead);
+      lock.lock();
+      auto next = std::make_shared<IndexState>(*state);
+      auto& segments = next->segments;
+      auto it = std::find(segments.begin(), segments.end(), run.front());
+      if (it == segments.end() || segments.end() - it < (long)run.size() ||
+          !std::equal(run.begin(), run.end(), it))
+        continue;
+      it = segments.erase(it, it + run.size());
+      segments.insert(it, merged);
+      Publish(std::move(next));
+    }
+  }
+
+  // Over every term of `segments`, with its document frequency; deleted
+  // docs count until their segment is compacted.
+  static std::shared_ptr<Suggester const> BuildSuggester(
+      std::vector<SegmentPtr> const& segments) {
+    std::unordered_map<std::string, uint32_t> counts;
+    for (auto const& seg : segments)
+      seg->index.dict.ForEach([&](uint32_t id, std::string_view term) {
+        counts[std::string(term)] += seg->index.postings.terms[id].count;
+      });
+    return std::make_shared<Suggester const>(std::move(counts));
+  }
+
+  // Up to n completions of `prefix`, most frequent first. The prefix is not
+  // echoed back, as it may end inside a UTF-8 character.
+  JsonWriter Suggest(std::string_view prefix, size_t n = SUGGEST_TOP) {
+    JsonWriter w;
+    w.Open('{').Key("suggestions").Open('[');
+    if (auto s = std::atomic_load(&suggester))
+      for (auto [term, df] : s->Complete(prefix, n))
+        w.Open('{').Key("term").String(term).Key("df").Number(df).Close('}');
+    w.Close(']').Close('}');
+    return w;
+  }
+
+  // Whether a segment or a pending doc of `state` holds `word`.
+  static bool Indexed(IndexState const& state, std::string_view word) {
+    for (auto const& seg : state.segments)
+      if (seg->index.dict.Find(word) >= 0) return true;
+    return std::any_of(state.pending.begin(), state.pending.end(),
+                       [&](auto const& doc) { return doc->Find(word); });
+  }
+
+  // Adds the terms of the suggester's dictionary within a few edits of
+  // each keyword the index lacks, their weight cut by FUZZY_PENALTY per
+  // edit: at most FUZZY_MAX_TERMS per keyword, nearest and most frequent
+  // first. The suggester can be SUGGEST_REBUILD behind, so a word it lacks
+  // is looked for in the live index before it counts as missing.
+  void ExpandFuzzy(KeywordList& kws) const {
+    auto s = std::atomic_load(&suggester);
+    if (!fuzzy || !s) return;
+    auto state = Snapshot();
+    for (size_t i = 0, n = kws.size(); i < n; ++i) {
+      auto runes = Runes(kws[i].word);
+      if (runes.size() < FUZZY_MIN_RUNES ||
+          std::binary_search(s->terms.begin(), s->terms.end(),
+                             kws[i].word) ||
+          Indexed(*state, kws[i].word))
+        continue;
+      uint32_t maxDist = runes.size() < FUZZY_TWO_EDITS ? 1 : 2;
+      auto matches = FuzzyMatches(s->terms, {std::move(runes), maxDist});
+      std::sort(matches.begin(), matches.end(), [&](auto a, auto b) {
+        return a.second != b.second ? a.second < b.second
+                                    : s->df[a.first] > s->df[b.first];
+      });
+      matches.resize(std::min(matches.size(), FUZZY_MAX_TERMS));
+      for (auto [t, dist] : matches) {
+        auto const& word = s->terms[t];
+        if (std::any_of(kws.begin(), kws.end(),
+                        [&](auto const& kw) { return kw.word == word; }))
+          continue;
+        auto kw = kws[i];
+        kw.word = word;
+        kw.weight *= std::pow(FUZZY_PENALTY, dist);
+        kws.push_back(std::move(kw));
+      }
+    }
+  }
+
+  static double GetNorm(KeywordList const& kws) {
     double norm = 0;
     for (auto const& kw : kws) norm += kw.weight * kw.weight;
     return sqrt(norm);
   }
 
-  Json KeywordsToJson(KeywordList const& kws) {
+  static Json KeywordsToJson(KeywordList const& kws) {
     Json jkws = Json::array();
-    for (auto kw : kws)  // 日
+    for (auto kw : kws) {  // 日
       jkws.push_back({{"word", kw.word}, {"weight", kw.weight}});
+      if (!kw.offsets.empty()) jkws.back()["positions"] = kw.offsets;
+    }
     return jkws;
   }
+  // Present only when some operator was ignored.
+  static void WriteIgnored(JsonWriter& w,
+                           std::vector<std::string> const& ignored) {
+    if (ignored.empty()) return;
+    w.Key("ignored").Open('[');
+    for (auto const& word : ignored) w.String(word);
+    w.Close(']');
+  }
+
+  static void WriteKeywords(JsonWriter& w, KeywordList const& kws) {
+    w.Open('[');
+    for (auto const& kw : kws) {
+      w.Open('{').Key("word").String(kw.word);
+      w.Key("weight").Number(kw.weight);
+      if (!kw.offsets.empty()) {
+        w.Key("positions").Open('[');
+        for (auto offset : kw.offsets) w.Number(offset);
+        w.Close(']');
+      }
+      w.Close('}');
+    }
+    w.Close(']');
+  }
+  static void WriteHighlights(
+      JsonWriter& w,
+      std::vector<std::pair<size_t, size_t>> const& highlights) {
+    w.Open('[');
+    for (auto [begin, end] : highlights)
+      w.Open('[').Number(begin).Number(end).Close(']');
+    w.Close(']');
+  }
 
   void AddEntry(std::string content) {
+    auto laps = metrics.Start();
     auto kws = jb.Keywords(content);
+    ToCharPositions(content, kws);
     auto w = sqrt(GetNorm(kws));
-    arts.push_back({content, w});
     Json jkws = KeywordsToJson(kws);
+    laps.Lap(PHASE_INGEST_SEGMENT);
+
+    auto id = database.insert((ArtRec){content, w, jkws.dump()});
+    if (part.Holds(id)) Index({content, w, id}, {0, w, ToTerms(kws)});
+    laps.Lap(PHASE_INGEST_WRITE);
+  }
+
+  // A document on its way through BatchAddEntry.
+  struct IngestDoc {
+    DocTable::Article art;
+    MemDoc doc;
+    std::string keywords;
+  };
 
-    database.insert((ArtRec){content, w, jkws.dump()});
+  // Bulk loads every file under `folder`, indexing each batch as a
+  // segment.
+  void BatchAddEntry(std::string folder,
+                     size_t workers = std::thread::hardware_concurrency()) {
+    IngestFolder(jb, folder, workers, [&](auto& batch) { AddBatch(batch); });
   }
 
-  void BatchAddEntry(std::string folder) {
+  // Readers feed a pool of workers that segment and weigh the files under
+  // `folder`, subdirectories included, with jb; the calling thread hands
+  // the results to store(batch) INGEST_BATCH at a time, in path order.
+  // A file that cannot be read or segmented is logged and skipped. If
+  // store throws, the pipeline is shut down and its threads joined before
+  // the error is rethrown.
+  template <class F>
+  static void IngestFolder(Jieba const& jb, std::string folder,
+                           size_t workers, F&& store) {
+    std::vector<std::filesystem::path> paths;
     for (auto const& it :
-         std::filesystem::directory_iterator(std::filesystem::path(folder))) {
-      std::cerr << "Adding..." << it.path() << '\n';
-      std::ifstream ifs(it.path());
-      AddEntry(std::string(std::istreambuf_iterator<char>(ifs),
-                           std::istreambuf_iterator<char>()));
+         std::filesystem::recursive_directory_iterator(folder))
+      if (it.is_regular_file()) paths.push_back(it.path());
+    std::sort(paths.begin(), paths.end());
+    workers = std::max<size_t>(1, workers);
+    size_t readers = std::min<size_t>(4, workers);
+    Stage read("read", readers), segment("segment", workers),
+        write("write", 1);
+    auto start = std::chrono::steady_clock::now();
+
+    // Items are numbered by their place in `paths`; a skipped file still
+    // passes through, empty, so the writer knows not to wait for it.
+    Channel<std::pair<size_t, std::optional<std::string>>> texts;
+    Channel<std::pair<size_t, std::optional<IngestDoc>>> parsed;
+    std::atomic<size_t> nextPath{0}, reading{readers}, segmenting{workers},
+        skipped{0};
+    std::atomic<bool> failed{false};
+    auto skip = [&](size_t j, char const* stage, std::exception const& e) {
+      LOG(WARN, "skipping {}: {} failed: {}", paths[j].string(), stage,
+          e.what());
+      ++skipped;
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < readers; ++i)
+      threads.emplace_back([&] {
+        for (size_t j; !failed && (j = nextPath++) < paths.size();) {
+          std::optional<std::string> text;
+          try {
+            text = read.Time([&] { return ReadFile(paths[j]); });
+          } catch (std::exception const& e) {
+            skip(j, "read", e);
+          }
+          texts.Push({j, std::move(text)});
+        }
+        if (!--reading) texts.Close();
+      });
+    for (size_t i = 0; i < workers; ++i)
+      threads.emplace_back([&] {
+        while (auto text = texts.Pop()) {
+          if (failed) break;
+          auto& [j, content] = *text;
+          std::optional<IngestDoc> doc;
+          try {
+            if (content) doc = segment.Time([&] {
+              auto laps = metrics.Start();
+              auto kws = jb.Keywords(*content);
+              ToCharPositions(*content, kws);
+              double w = sqrt(GetNorm(kws));
+              laps.Lap(PHASE_INGEST_SEGMENT);
+              return IngestDoc{{std::move(*content), w, 0},
+                               {0, w, ToTerms(kws)},
+                               KeywordsToJson(kws).dump()};
+            });
+          } catch (std::exception const& e) {
+            skip(j, "segmenting", e);
+          }
+          parsed.Push({j, std::move(doc)});
+        }
+        if (!--segmenting) parsed.Close();
+      });
+
+    std::map<size_t, std::optional<IngestDoc>> early;
+    std::vector<IngestDoc> batch;
+    size_t next = 0;
+    auto flush = [&] {
+      write.Time([&] {
+        metrics.Time(PHASE_INGEST_WRITE, [&] { store(batch); });
+      });
+      batch.clear();
+    };
+    std::exception_ptr error;
+    try {
+      while (auto in = parsed.Pop()) {
+        early.emplace(in->first, std::move(in->second));
+        for (auto it = early.begin(); it != early.end() && it->first == next;
+             it = early.erase(it), ++next) {
+          if (!it->second) continue;
+          batch.push_back(std::move(*it->second));
+          if (batch.size() == INGEST_BATCH) flush();
+        }
+      }
+      flush();
+    } catch (...) {
+      error = std::current_exception();
+      failed = true;
+      texts.Close();
+      parsed.Close();
+    }
+    for (auto& t : threads) t.join();
+    if (error) std::rethrow_exception(error);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    ReportIngest(paths.size() - skipped, elapsed.count(),
+                 {&read, &segment, &write});
+  }
+
+  // Inserts the batch into SQLite in one transaction.
+  static void InsertBatch(std::vector<IngestDoc>& batch) {
+    if (batch.empty()) return;
+    metrics.ingested.Add(batch.size());
+    database.transaction([&] {
+      for (auto& in : batch)
+        in.art.rowid = database.insert(
+            (ArtRec){in.art.content, in.art.w, std::move(in.keywords)});
+      return true;
+    });
+  }
+
+  // Inserts the batch, then appends it to the index as a segment of its
+  // own.
+  void AddBatch(std::vector<IngestDoc>& batch) {
+    InsertBatch(batch);
+    // Other shards index the rest.
+    batch.erase(std::remove_if(
+                    batch.begin(), batch.end(),
+                    [&](auto& in) { return !part.Holds(in.art.rowid); }),
+                batch.end());
+    if (batch.empty()) return;
+    std::lock_guard<std::mutex> lock(writeMutex);
+    auto next = std::make_shared<IndexState>(*state);
+    if (!next->pending.empty()) {
+      next->segments.push_back(SealSegment(next->pending, bm25));
+      next->pending.clear();
+    }
+    std::vector<MemDocPtr> added;
+    for (auto& in : batch) {
+      in.doc.id = docs.size();
+      in.doc.length = DocLength(in.doc.terms);
+      docs.Add(std::move(in.art));
+      added.push_back(std::make_shared<MemDoc const>(std::move(in.doc)));
+    }
+    next->segments.push_back(SealSegment(added, bm25));
+    Publish(std::move(next));
+    mergeCv.notify_one();
+  }
+
+  // ANYTIME ranks by BM25 impacts in impact order within `anytime`, and
+  // may return an approximate top-k when that runs out.
+  enum class Mode { EXHAUSTIVE, WAND, ANYTIME };
+  // COSINE divides the summed keyword weights by the doc norm; BM25 sums
+  // the impacts stored in the postings.
+  enum class Scoring { COSINE, BM25 };
+
+  // ANYTIME has only the BM25 impacts to go by, so it takes no other
+  // scoring.
+  static void CheckScoring(Mode mode, Scoring scoring) {
+    if (mode == Mode::ANYTIME && scoring != Scoring::BM25)
+      throw std::invalid_argument("anytime mode only scores by bm25");
+  }
+
+  static void Count(Scanned scanned) {
+    metrics.postings.Add(scanned.postings);
+    metrics.candidates.Add(scanned.candidates);
+  }
+
+  // How often each keyword occurs in the query, for BM25.
+  static uint32_t QueryCount(KeywordList::value_type const& kw) {
+    return std::max<size_t>(1, kw.offsets.size());
+  }
+
+  // A pending doc's score. BM25 scores it from the same impacts its
+  // postings will hold. Cosine uses its raw weights, while sealing
+  // quantizes them against each term's largest weight in the new segment,
+  // which is not known until then. So a doc's cosine score can move by up
+  // to half a quantum when it is sealed, and hits with nearly equal scores
+  // can swap places. Sealing publishes a new generation, so no cached
+  // ranking mixes the two.
+  double ScorePending(MemDoc const& doc, KeywordList const& kws,
+                      Scoring scoring) const {
+    if (scoring == Scoring::BM25) {
+      uint32_t acc = 0;
+      for (auto const& kw : kws)
+        acc += doc.Impact(kw.word, bm25) * QueryCount(kw);
+      return acc * BM25_QUANTUM;
     }
+    double score = 0;
+    for (auto const& kw : kws) score += doc.Weight(kw.word) * kw.weight;
+    return score / doc.w;
   }
 
-  Json Search(std::string sentence) {
-    auto kws = jb.Keywords(sentence);
-    std::cerr << kws << '\n';
-    std::vector<double> norms(arts.size(), 0);
-    for (size_t i = 0; i < kws.size(); ++i) {
-      auto p = tr.Query(kws[i].word);
-      if (p) {
-        for (auto const& [id, w] : *p) norms[id] += w * kws[i].weight;
+  using DocFilter = std::function<bool(ArticleID)>;
+
+  // Scores every posting of every query term into a dense accumulator;
+  // kept as the reference the pruned modes must agree with. Docs for which
+  // `dead` holds are left out.
+  std::vector<Hit> RankExhaustive(KeywordList const& kws, size_t k,
+                                  Scoring scoring, IndexState const& state,
+                                  DocFilter const& dead, Metrics::Laps& laps) {
+    bool bm = scoring == Scoring::BM25;
+    // Per segment, one per keyword.
+    std::vector<std::optional<PostingCursor>> cursors;
+    for (auto const& seg : state.segments)
+      for (auto const& kw : kws) cursors.push_back(seg->index.Query(kw.word));
+    laps.Lap(PHASE_LOOKUP);
+    std::vector<double> norms(state.docs, 0);
+    std::vector<uint32_t> impacts(bm ? state.docs : 0, 0);
+    for (size_t c = 0; c < cursors.size(); ++c) {
+      auto& p = cursors[c];
+      if (!p) continue;
+      auto const& kw = kws[c % kws.size()];
+      for (; p->Doc() != END_OF_LIST; p->Next())
+        if (bm)
+          impacts[p->Doc()] += p->Impact() * QueryCount(kw);
+        else
+          norms[p->Doc()] += p->Weight() * kw.weight;
+      metrics.postings.Add(p->decoded);
+    }
+    for (size_t i = 0; i < state.docs; ++i)
+      norms[i] = bm ? impacts[i] * BM25_QUANTUM : norms[i] / docs.Norm(i);
+    for (auto const& doc : state.pending)
+      norms[doc->id] = ScorePending(*doc, kws, scoring);
+    laps.Lap(PHASE_ACCUMULATE);
+    std::vector<Hit> rank;
+    for (size_t i = 0; i < state.docs; ++i)
+      if (norms[i] > 0 && !dead(i)) rank.push_back({(ArticleID)i, norms[i]});
+    metrics.candidates.Add(rank.size());
+    k = std::min(k, rank.size());
+    std::partial_sort(rank.begin(), rank.begin() + k, rank.end(), Better);
+    rank.resize(k);
+    laps.Lap(PHASE_TOPK);
+    return rank;
+  }
+
+  // Docs holding every word of some clause, sorted.
+  std::vector<ArticleID> Matching(
+      std::vector<AnalyzedQuery::Clause> const& clauses,
+      IndexState const& state) {
+    std::vector<ArticleID> out;
+    for (auto const& clause : clauses) {
+      for (auto const& seg : state.segments) {
+        std::vector<PostingCursor> cursors;
+        for (auto const& word : clause)
+          if (auto p = seg->index.Query(word)) cursors.push_back(*p);
+        if (cursors.size() < clause.size()) continue;
+        std::vector<PostingCursor*> all;
+        for (auto& c : cursors) all.push_back(&c);
+        Intersect(all, [&](ArticleID doc) { out.push_back(doc); });
       }
+      for (auto const& doc : state.pending)
+        if (std::all_of(clause.begin(), clause.end(),
+                        [&](auto const& w) { return doc->Find(w); }))
+          out.push_back(doc->id);
     }
-    std::vector<int> rank;
-    for (size_t i = 0; i < arts.size(); ++i) {
-      norms[i] /= arts[i].w;
-      if (!arts[i].deleted && norms[i] > 0) rank.push_back(i);
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+  }
+
+  // Phrase and required-word queries: docs holding every phrase word and
+  // every required word are found by intersecting the words' cursors,
+  // checked against the phrases by their positions and scored like any
+  // other hit.
+  std::vector<Hit> RankConjunctive(AnalyzedQuery const& q, size_t k,
+                                   Scoring scoring, IndexState const& state,
+                                   DocFilter const& dead,
+                                   Metrics::Laps& laps) {
+    auto const& kws = q.kws;
+    auto const& phrases = q.phrases;
+    auto const& required = q.required;
+    std::vector<std::string> words;
+    std::vector<std::vector<size_t>> slots(phrases.size());
+    auto add = [&](std::string const& word) {
+      size_t i = std::find(words.begin(), words.end(), word) - words.begin();
+      if (i == words.size()) words.push_back(word);
+      return i;
+    };
+    for (size_t i = 0; i < phrases.size(); ++i)
+      for (auto const& word : phrases[i].words)
+        slots[i].push_back(add(word));
+    size_t phraseWords = words.size();
+    for (auto const& clause : required)
+      for (auto const& word : clause) add(word);
+    std::vector<Positions> positions(phraseWords);
+    Scanned scanned;
+    auto match = [&] {
+      std::vector<Positions> own;
+      for (size_t i = 0; i < phrases.size(); ++i) {
+        own.clear();
+        for (auto w : slots[i]) own.push_back(positions[w]);
+        if (!phrases[i].Match(own)) return false;
+      }
+      return true;
+    };
+
+    // The segments holding every word, with the words' cursors and the
+    // keywords' scorers.
+    struct Found {
+      Segment const* seg;
+      std::vector<PostingCursor> cursors;
+      std::vector<std::optional<PostingCursor>> scorers;
+    };
+    std::vector<Found> found;
+    for (auto const& seg : state.segments) {
+      Found f{seg.get(), {}, {}};
+      for (auto const& word : words)
+        if (auto p = seg->index.Query(word)) f.cursors.push_back(*p);
+      if (f.cursors.size() < words.size()) continue;
+      for (auto const& kw : kws)
+        f.scorers.push_back(seg->index.Query(kw.word));
+      found.push_back(std::move(f));
     }
-    std::sort(rank.begin(), rank.end(),
-              [&](int a, int b) -> bool { return norms[a] > norms[b]; });
-    Json j;
-    for (auto i : rank) {
-      j.push_back({{"content", arts[i].content}, {"norm", norms[i]}});
-      if (j.size() == 20) break;
+    laps.Lap(PHASE_LOOKUP);
+
+    TopK top(k);
+    for (auto& f : found) {
+      auto const* seg = f.seg;
+      auto& cursors = f.cursors;
+      auto& scorers = f.scorers;
+      std::vector<PostingCursor*> all;
+      for (auto& c : cursors) all.push_back(&c);
+      Intersect(all, [&](ArticleID doc) {
+        scanned.candidates++;
+        if (dead(doc)) return;
+        for (size_t w = 0; w < phraseWords; ++w)
+          cursors[w].ReadPositions(positions[w]);
+        if (!match()) return;
+        double score = 0;
+        uint32_t acc = 0;
+        for (size_t i = 0; i < kws.size(); ++i) {
+          if (!scorers[i]) continue;
+          scorers[i]->NextGEQ(doc);
+          if (scorers[i]->Doc() != doc) continue;
+          score += scorers[i]->Weight() * kws[i].weight;
+          acc += scorers[i]->Impact() * QueryCount(kws[i]);
+        }
+        top.Push({doc, scoring == Scoring::BM25 ? acc * BM25_QUANTUM
+                                                : score / seg->Norm(doc)});
+      });
+      for (auto const& c : cursors) scanned.postings += c.decoded;
+      for (auto const& c : scorers)
+        if (c) scanned.postings += c->decoded;
+    }
+    Count(scanned);
+    for (auto const& doc : state.pending) {
+      bool all = !dead(doc->id);
+      for (size_t w = 0; all && w < words.size(); ++w) {
+        auto t = doc->Find(words[w]);
+        all = t;
+        if (t && w < phraseWords) positions[w] = t->positions;
+      }
+      if (!all || !match()) continue;
+      top.Push({doc->id, ScorePending(*doc, kws, scoring)});
     }
-    return {{"keywords", KeywordsToJson(kws)}, {"results", j}};
+    laps.Lap(PHASE_ACCUMULATE);
+    auto hits = top.Sorted();
+    laps.Lap(PHASE_TOPK);
+    return hits;
   }
 
-  void Delete(size_t id) {
-    arts[id].deleted = true;
-    if (++deletedCount == 1000) {
-      arts = {};
-      tr.~Trie();
-      Load();
+  // Ranks many keyword lists together, exactly as RankExhaustive would.
+  // Per segment, the postings of every distinct word are decoded once and
+  // merged in doc order; each posting goes to every query holding the
+  // word, and a doc's scores are final once the merge moves past it.
+  std::vector<std::vector<Hit>> RankBatch(
+      std::vector<KeywordList const*> const& queries, size_t k,
+      Scoring scoring) {
+    auto state = Snapshot();
+    bool bm = scoring == Scoring::BM25;
+    std::vector<std::string_view> words;
+    std::vector<std::vector<std::pair<size_t, size_t>>> users;  // {query, kw}
+    std::unordered_map<std::string_view, size_t> ids;
+    for (size_t q = 0; q < queries.size(); ++q)
+      for (size_t i = 0; i < queries[q]->size(); ++i) {
+        auto [it, added] = ids.emplace((*queries[q])[i].word, words.size());
+        if (added) {
+          words.push_back(it->first);
+          users.emplace_back();
+        }
+        users[it->second].push_back({q, i});
+      }
+
+    std::vector<TopK> tops(queries.size(), TopK(k));
+    std::vector<double> acc(queries.size());
+    std::vector<bool> hit(queries.size());
+    std::vector<size_t> touched;
+    Scanned scanned;
+    using Cursor = std::pair<PostingCursor, size_t>;  // {postings, word}
+    auto later = [](Cursor* a, Cursor* b) {
+      return a->first.Doc() > b->first.Doc();
+    };
+    for (auto const& seg : state->segments) {
+      std::vector<Cursor> cursors;
+      for (size_t w = 0; w < words.size(); ++w)
+        if (auto p = seg->index.Query(words[w])) cursors.push_back({*p, w});
+      std::vector<Cursor*> heap;
+      for (auto& c : cursors) heap.push_back(&c);
+      std::make_heap(heap.begin(), heap.end(), later);
+      while (!heap.empty()) {
+        ArticleID doc = heap.front()->first.Doc();
+        ++scanned.candidates;
+        while (!heap.empty() && heap.front()->first.Doc() == doc) {
+          std::pop_heap(heap.begin(), heap.end(), later);
+          auto& [c, w] = *heap.back();
+          for (auto [q, i] : users[w]) {
+            auto const& kw = (*queries[q])[i];
+            if (!hit[q]) touched.push_back(q);
+            hit[q] = true;
+            acc[q] +=
+                bm ? c.Impact() * QueryCount(kw) : c.Weight() * kw.weight;
+          }
+          c.Next();
+          if (c.Doc() == END_OF_LIST)
+            heap.pop_back();
+          else
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+        bool dead = docs.Deleted(doc);
+        for (auto q : touched) {
+          if (!dead)
+            tops[q].Push({doc, bm ? acc[q] * BM25_QUANTUM
+                                  : acc[q] / seg->Norm(doc)});
+          acc[q] = 0;
+          hit[q] = false;
+        }
+        touched.clear();
+      }
+      for (auto const& [c, _] : cursors) scanned.postings += c.decoded;
+    }
+    Count(scanned);
+
+    std::vector<std::vector<Hit>> ranked;
+    for (size_t q = 0; q < queries.size(); ++q) {
+      for (auto const& doc : state->pending)
+        if (!docs.Deleted(doc->id))
+          tops[q].Push({doc->id, ScorePending(*doc, *queries[q], scoring)});
+      ranked.push_back(tops[q].Sorted());
     }
+    return ranked;
   }
-} db;
+
+  // Score-at-a-time over every segment's impact-ordered postings; pending
+  // docs are scored in full.
+  std::vector<Hit> RankAnytime(KeywordList const& kws, size_t k,
+                               IndexState const& state, DocFilter const& dead,
+                               Metrics::Laps& laps) {
+    AnytimeRanker ranker(accumulators, state.docs);
+    for (auto const& seg : state.segments)
+      for (auto const& kw : kws) {
+        auto t = seg->index.dict.Find(kw.word);
+        if (t >= 0) ranker.Add(seg->index.impacts, t, QueryCount(kw));
+      }
+    laps.Lap(PHASE_LOOKUP);
+    ranker.Run(anytime);
+    Count({ranker.processed, ranker.touched.size()});
+    TopK top(k);
+    for (auto const& doc : state.pending)
+      if (!dead(doc->id))
+        top.Push({doc->id, ScorePending(*doc, kws, Scoring::BM25)});
+    laps.Lap(PHASE_ACCUMULATE);
+    for (auto doc : ranker.touched)
+      if (!dead(doc)) top.Push({doc, ranker.acc[doc] * BM25_QUANTUM});
+    auto hits = top.Sorted();
+    laps.Lap(PHASE_TOPK);
+    return hits;
+  }
+
+  // Phrases and required words are matched whatever the mode; excluded
+  // docs are filtered out as deleted ones are. ANYTIME with any scoring
+  // but BM25 throws std::invalid_argument. Its lookup, accumulate and
+  // top-k phases are timed on `laps`.
+  std::vector<Hit> Rank(AnalyzedQuery const& q, size_t k, Mode mode,
+                        Scoring scoring = Scoring::COSINE) {
+    auto laps = metrics.Start();
+    return Rank(q, k, mode, scoring, laps);
+  }
+  std::vector<Hit> Rank(AnalyzedQuery const& q, size_t k, Mode mode,
+                        Scoring scoring, Metrics::Laps& laps) {
+    CheckScoring(mode, scoring);
+    auto state = Snapshot();
+    auto excluded = Matching(q.excluded, *state);
+    DocFilter deleted = [&](ArticleID i) {
+      return docs.Deleted(i) ||
+             std::binary_search(excluded.begin(), excluded.end(), i);
+    };
+    auto const& kws = q.kws;
+    if (!q.phrases.empty() || !q.required.empty())
+      return RankConjunctive(q, k, scoring, *state, deleted, laps);
+    if (mode == Mode::EXHAUSTIVE)
+      return RankExhaustive(kws, k, scoring, *state, deleted, laps);
+    if (mode == Mode::ANYTIME)
+      return RankAnytime(kws, k, *state, deleted, laps);
+
+    // Term IDs of the keywords in each segment, found once for all the
+    // doc ranges, with the keywords' indices.
+    auto const& segments = state->segments;
+    std::vector<std::vector<std::pair<uint32_t, size_t>>> found(
+        segments.size());
+    for (size_t g = 0; g < segments.size(); ++g)
+      for (size_t i = 0; i < kws.size(); ++i) {
+        auto t = segments[g]->index.dict.Find(kws[i].word);
+        if (t >= 0) found[g].push_back({(uint32_t)t, i});
+      }
+    laps.Lap(PHASE_LOOKUP);
+
+    size_t n = std::clamp<size_t>(state->docs / SHARD_MIN_DOCS, 1, shards);
+    std::vector<TopK> local(n, TopK(k));
+    pool.ParallelFor(n, [&](size_t s) {
+      ArticleID begin = state->docs * s / n, end = state->docs * (s + 1) / n;
+      for (size_t g = 0; g < segments.size(); ++g) {
+        auto const& seg = segments[g];
+        if (seg->end <= begin || seg->first >= end) continue;
+        std::vector<QueryTerm> terms;
+        for (auto [t, i] : found[g])
+          terms.push_back({PostingCursor(seg->index.postings, t),
+                           kws[i].weight, QueryCount(kws[i])});
+        if (scoring == Scoring::BM25)
+          Count(Wand(std::move(terms), local[s], Bm25Scoring(), deleted, begin,
+                     end));
+        else
+          Count(Wand(std::move(terms), local[s],
+                     CosineScoring{[&](ArticleID i) { return seg->Norm(i); }},
+                     deleted, begin, end));
+      }
+    });
+    TopK top(k);
+    for (auto const& doc : state->pending)
+      if (!deleted(doc->id))
+        top.Push({doc->id, ScorePending(*doc, kws, scoring)});
+    laps.Lap(PHASE_ACCUMULATE);
+    for (auto const& t : local)
+      for (auto hit : t.heap) top.Push(hit);
+    auto hits = top.Sorted();
+    laps.Lap(PHASE_TOPK);
+    return hits;
+  }
+
+  // The RESULTS best hits, from the cache when the index has not changed
+  // since they were ranked. On a miss, the cache lookup and Rank()'s
+  // phases are timed on `laps`; a hit takes no laps.
+  std::vector<Hit> Hits(AnalyzedQuery const& q, Mode mode, Scoring scoring) {
+    auto laps = metrics.Start();
+    return Hits(q, mode, scoring, laps);
+  }
+  std::vector<Hit> Hits(AnalyzedQuery const& q, Mode mode, Scoring scoring,
+                        Metrics::Laps& laps) {
+    auto generation = Snapshot()->generation;
+    auto key = CacheKey(q, mode, scoring);
+    auto hits = cache.Get(key, generation);
+    (hits ? metrics.cacheHits : metrics.cacheMisses).Add(1);
+    if (!hits) {
+      laps.Lap(PHASE_CACHE);
+      hits = Rank(q, RESULTS, mode, scoring, laps);
+      cache.Put(std::move(key), generation, *hits);
+    }
+    return std::move(*hits);
+  }
+
+  // See Rank() for the modes and Results() for snippetLength; Document()
+  // has the whole content. The response refers to docs' contents, which
+  // stay put for the engine's lifetime.
+  JsonWriter Search(std::string sentence, Mode mode = Mode::WAND,
+              Scoring scoring = Scoring::COSINE, size_t snippetLength = 0) {
+    CheckScoring(mode, scoring);
+    metrics.searches.Add(1);
+    auto laps = metrics.Start();
+    auto q = AnalyzeQuery(jb, sentence);
+    laps.Lap(PHASE_ANALYZE);
+    ExpandFuzzy(q.kws);
+    laps.Lap(PHASE_FUZZY);
+    LOG(DEBUG, "keywords: {}", q.kws);
+    auto ranking = laps.last;
+    auto hits = Hits(q, mode, scoring, laps);
+    laps.Lap(PHASE_RANK, ranking);
+    JsonWriter w;
+    Results(w, q, hits, snippetLength);
+    laps.Lap(PHASE_RESULTS);
+    return w;
+  }
+
+  // Searches for every sentence at once. The sentences are segmented in
+  // parallel; those not in the cache are ranked together by RankBatch,
+  // except for anytime queries and those with phrases or operators, which
+  // rank one by one.
+  JsonWriter SearchBatch(std::vector<std::string> const& sentences,
+                         Mode mode = Mode::WAND,
+                         Scoring scoring = Scoring::COSINE,
+                         size_t snippetLength = 0) {
+    CheckScoring(mode, scoring);
+    size_t n = sentences.size();
+    metrics.searches.Add(n);
+    std::vector<AnalyzedQuery> queries(n);
+    pool.ParallelFor(n, [&](size_t i) {
+      queries[i] = AnalyzeQuery(jb, sentences[i]);
+      ExpandFuzzy(queries[i].kws);
+    });
+
+    auto generation = Snapshot()->generation;
+    std::vector<std::optional<std::vector<Hit>>> hits(n);
+    std::vector<size_t> batched;
+    std::vector<KeywordList const*> batchKws;
+    for (size_t i = 0; i < n; ++i) {
+      auto const& q = queries[i];
+      hits[i] = cache.Get(CacheKey(q, mode, scoring), generation);
+      (hits[i] ? metrics.cacheHits : metrics.cacheMisses).Add(1);
+      if (hits[i]) continue;
+      if (q.Plain() && mode != Mode::ANYTIME) {
+        batched.push_back(i);
+        batchKws.push_back(&q.kws);
+        continue;
+      }
+      hits[i] = Rank(q, RESULTS, mode, scoring);
+      cache.Put(CacheKey(q, mode, scoring), generation, *hits[i]);
+    }
+    auto ranked = RankBatch(batchKws, RESULTS, scoring);
+    for (size_t b = 0; b < batched.size(); ++b) {
+      auto const& q = queries[batched[b]];
+      cache.Put(CacheKey(q, mode, scoring), generation, ranked[b]);
+      hits[batched[b]] = std::move(ranked[b]);
+    }
+
+    JsonWriter w;
+    w.Open('{').Key("results").Open('[');
+    for (size_t i = 0; i < n; ++i)
+      Results(w, queries[i], *hits[i], snippetLength);
+    w.Close(']').Close('}');
+    return w;
+  }
+
+  // The response to one query. With a snippetLength, results carry a
+  // snippet around the query terms with its highlights instead of the
+  // whole content.
+  void Results(JsonWriter& w, AnalyzedQuery const& q,
+               std::vector<Hit> const& hits, size_t snippetLength) {
+    auto const& kws = q.kws;
+    w.Open('{').Key("keywords");
+    WriteKeywords(w, kws);
+    WriteIgnored(w, q.ignored);
+    // No hits is null, as the frontend expects.
+    if (hits.empty()) {
+      w.Key("results").Null().Close('}');
+      return;
+    }
+    w.Key("results").Open('[');
+    for (auto [i, norm] : hits) {
+      w.Open('{').Key("id").Number(i);
+      w.Key("norm").Number(norm);
+      if (snippetLength) {
+        auto snippet = MakeSnippet(docs.Content(i), kws, snippetLength);
+        w.Key("snippet").String(snippet.text).Key("highlights");
+        WriteHighlights(w, snippet.highlights);
+      } else {
+        w.Key("content").View(docs.Content(i));
+      }
+      w.Close('}');
+    }
+    w.Close(']').Close('}');
+  }
+
+  // Canonical form of a query: its keywords sorted, with weights rounded to
+  // 1 / CACHE_WEIGHT_SCALE, so phrasings that segment alike share a key.
+  static std::string CacheKey(AnalyzedQuery const& q, Mode mode,
+                              Scoring scoring) {
+    std::vector<std::pair<std::string_view, long>> words;
+    for (auto const& kw : q.kws)
+      words.push_back({kw.word, std::lround(kw.weight * CACHE_WEIGHT_SCALE)});
+    std::sort(words.begin(), words.end());
+    std::string key{(char)mode, (char)scoring};
+    for (auto [word, weight] : words)
+      key.append(word).append(1, '\0').append(std::to_string(weight)) += ';';
+    for (auto const& p : q.phrases) {
+      key += '"' + std::to_string(p.slop) + ',' + std::to_string(p.length);
+      for (auto [w, offset] : p.slots)
+        key.append(1, ';').append(p.words[w]) += '@' + std::to_string(offset);
+    }
+    for (auto const& [op, clauses] : {std::pair{'+', &q.required},
+                                      std::pair{'-', &q.excluded}})
+      for (auto const& clause : *clauses) {
+        key += op;
+        for (auto const& word : clause) key.append(word) += ',';
+      }
+    return key;
+  }
+
+  Json Stats() {
+    return {{"cache",
+             {{"hits", cache.hits.load()},
+              {"misses", cache.misses.load()},
+              {"evictions", cache.evictions.load()},
+              {"invalidations", cache.invalidations.load()},
+              {"entries", cache.size()}}},
+            {"generation", Snapshot()->generation}};
+  }
+
+  std::optional<JsonWriter> Document(size_t id) {
+    if (id >= docs.size() || docs.Deleted(id)) return std::nullopt;
+    JsonWriter w;
+    w.Open('{').Key("id").Number(id);
+    w.Key("content").View(docs.Content(id)).Close('}');
+    return w;
+  }
+
+  // Tombstones the doc; searches skip it at once, and the merger drops its
+  // postings once enough of its segment is deleted.
+  void Delete(size_t id) {
+    if (id >= docs.size()) return;
+    docs.Delete(id);
+    std::lock_guard<std::mutex> lock(writeMutex);
+    Publish(std::make_shared<IndexState>(*state));
+    mergeCv.notify_one();
+  }
+};
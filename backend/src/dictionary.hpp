@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "coding.hpp"
+#include "storage.hpp"
+
+const int DICT_BLOCK = 16;
+
+// Sorted, front-coded term dictionary. Terms are cut into blocks of
+// DICT_BLOCK; the head of each block is stored whole so blocks can be
+// binary searched, the rest as (shared prefix, suffix) against the previous
+// term. A term's ID is its rank in sorted order.
+struct TermDict {
+  Array<uint8_t> data;
+  Array<uint32_t> blocks;
+  uint32_t size = 0;
+  uint64_t trieNodes = 1;
+
+  // `terms` must be sorted and unique.
+  void Build(std::vector<std::string> const& terms) {
+    std::vector<uint8_t> data;
+    std::vector<uint32_t> blocks;
+    size = terms.size();
+    trieNodes = 1;
+    for (uint32_t i = 0; i < size; ++i) {
+      auto const& t = terms[i];
+      size_t lcp = 0;
+      if (i) {
+        auto const& prev = terms[i - 1];
+        while (lcp < prev.size() && lcp < t.size() && prev[lcp] == t[lcp])
+          ++lcp;
+      }
+      trieNodes += t.size() - lcp;
+      if (i % DICT_BLOCK == 0) {
+        blocks.push_back(data.size());
+        lcp = 0;
+      } else {
+        PutVarint(data, lcp);
+      }
+      PutVarint(data, t.size() - lcp);
+      data.insert(data.end(), t.begin() + lcp, t.end());
+    }
+    this->data = std::move(data);
+    this->blocks = std::move(blocks);
+  }
+
+  std::string_view Head(size_t block) const {
+    uint8_t const* p = data.data() + blocks[block];
+    uint32_t len = GetVarint(p);
+    return {(char const*)p, len};
+  }
+
+  // Term ID of `word`, or -1 if it is not in the dictionary.
+  int64_t Find(std::string_view word) const {
+    if (!size || word < Head(0)) return -1;
+    size_t lo = 0, hi = blocks.size();
+    while (hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+      (Head(mid) <= word ? lo : hi) = mid;
+    }
+    // Scans the block in place, tracking how many bytes the previous term
+    // shares with `word`: a term sharing more than that with its
+    // predecessor still sorts before `word`, one sharing less sorts after
+    // it, and only an equal share needs its suffix compared.
+    uint8_t const* p = data.data() + blocks[lo];
+    size_t match = 0;
+    uint32_t end = std::min<uint32_t>(size, (lo + 1) * DICT_BLOCK);
+    for (uint32_t id = lo * DICT_BLOCK; id < end; ++id) {
+      uint32_t lcp = id % DICT_BLOCK ? GetVarint(p) : 0;
+      uint32_t len = GetVarint(p);
+      std::string_view suffix((char const*)p, len);
+      p += len;
+      if (lcp > match) continue;
+      if (lcp < match) break;
+      auto rest = word.substr(lcp);
+      size_t k = 0;
+      while (k < suffix.size() && k < rest.size() && suffix[k] == rest[k]) ++k;
+      match = lcp + k;
+      int c = suffix.compare(rest);
+      if (c == 0) return id;
+      if (c > 0) break;
+    }
+    return -1;
+  }
+
+  std::string Term(uint32_t id) const {
+    uint8_t const* p = data.data() + blocks[id / DICT_BLOCK];
+    std::string term;
+    for (uint32_t i = 0; i <= id % DICT_BLOCK; ++i) Next(p, term, i == 0);
+    return term;
+  }
+
+  // Visits every term in ID order.
+  template <class F>
+  void ForEach(F f) const {
+    uint8_t const* p = data.data();
+    std::string term;
+    for (uint32_t id = 0; id < size; ++id) {
+      Next(p, term, id % DICT_BLOCK == 0);
+      f(id, std::string_view(term));
+    }
+  }
+
+  size_t MemoryUsage() const {
+    return sizeof(*this) + data.Bytes() + blocks.Bytes();
+  }
+
+  // What the same terms cost in the old 256-way pointer trie, which spent
+  // one node per distinct byte prefix.
+  size_t TrieFootprint() const {
+    return trieNodes * (sizeof(void*) * 256 +
+                        sizeof(std::list<std::pair<size_t, double>>));
+  }
+
+ private:
+  static void Next(uint8_t const*& p, std::string& term, bool head) {
+    uint32_t lcp = head ? 0 : GetVarint(p);
+    uint32_t len = GetVarint(p);
+    term.resize(lcp);
+    term.append((char const*)p, len);
+    p += len;
+  }
+};
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string_view>
+
+#include "postings.hpp"
+#include "storage.hpp"
+
+// Append-only sequence with one writer and any number of concurrent
+// readers. Elements live in fixed chunks that never move, and size() is
+// only bumped once the new element is in place, so a reader may index
+// anything below a size() it has seen. Moves are for setup only.
+template <class T, size_t CHUNK = 4096, size_t MAX_CHUNKS = 1 << 16>
+struct AppendOnly {
+  std::unique_ptr<std::atomic<T*>[]> chunks;
+  std::atomic<size_t> n{0};
+
+  AppendOnly() : chunks(new std::atomic<T*>[MAX_CHUNKS]()) {}
+  AppendOnly(AppendOnly&& o) : AppendOnly() { *this = std::move(o); }
+  AppendOnly& operator=(AppendOnly&& o) {
+    clear();
+    chunks.swap(o.chunks);
+    n.store(o.n.exchange(0));
+    return *this;
+  }
+  ~AppendOnly() { clear(); }
+
+  size_t size() const { return n.load(std::memory_order_acquire); }
+  bool empty() const { return !size(); }
+  T const& operator[](size_t i) const {
+    return chunks[i / CHUNK].load(std::memory_order_acquire)[i % CHUNK];
+  }
+
+  void push_back(T x) {
+    size_t i = n.load(std::memory_order_relaxed);
+    auto& chunk = chunks[i / CHUNK];
+    if (!chunk.load(std::memory_order_relaxed))
+      chunk.store(new T[CHUNK], std::memory_order_release);
+    chunk.load(std::memory_order_relaxed)[i % CHUNK] = std::move(x);
+    n.store(i + 1, std::memory_order_release);
+  }
+
+  void clear() {
+    if (!chunks) return;
+    for (size_t i = 0; i < MAX_CHUNKS; ++i)
+      delete[] chunks[i].exchange(nullptr);
+    n = 0;
+  }
+};
+
+// Bitset that any thread may set bits in while others test them.
+struct AtomicBitset {
+  static const size_t CHUNK_WORDS = 1024;
+  static const size_t MAX_CHUNKS = 1 << 12;
+
+  std::unique_ptr<std::atomic<std::atomic<uint64_t>*>[]> chunks;
+
+  AtomicBitset()
+      : chunks(new std::atomic<std::atomic<uint64_t>*>[MAX_CHUNKS]()) {}
+  AtomicBitset(AtomicBitset&& o) : AtomicBitset() { *this = std::move(o); }
+  AtomicBitset& operator=(AtomicBitset&& o) {
+    clear();
+    chunks.swap(o.chunks);
+    return *this;
+  }
+  ~AtomicBitset() { clear(); }
+
+  bool Test(size_t i) const {
+    auto chunk = chunks[i / 64 / CHUNK_WORDS].load(std::memory_order_acquire);
+    return chunk &&
+           chunk[i / 64 % CHUNK_WORDS].load(std::memory_order_relaxed) >>
+                   (i % 64) & 1;
+  }
+
+  void Set(size_t i) {
+    auto& slot = chunks[i / 64 / CHUNK_WORDS];
+    auto chunk = slot.load(std::memory_order_acquire);
+    if (!chunk) {
+      auto fresh = new std::atomic<uint64_t>[CHUNK_WORDS]();
+      if (slot.compare_exchange_strong(chunk, fresh))
+        chunk = fresh;
+      else
+        delete[] fresh;
+    }
+    chunk[i / 64 % CHUNK_WORDS].fetch_or(1ull << (i % 64));
+  }
+
+  // Set bits in [begin, end).
+  size_t Count(size_t begin, size_t end) const {
+    size_t n = 0;
+    for (size_t i = begin; i < end;) {
+      if (i % 64 || end - i < 64) {
+        n += Test(i++);
+        continue;
+      }
+      auto chunk = chunks[i / 64 / CHUNK_WORDS].load(std::memory_order_acquire);
+      if (chunk)
+        n += __builtin_popcountll(
+            chunk[i / 64 % CHUNK_WORDS].load(std::memory_order_relaxed));
+      i += 64;
+    }
+    return n;
+  }
+
+  void clear() {
+    if (!chunks) return;
+    for (size_t i = 0; i < MAX_CHUNKS; ++i)
+      delete[] chunks[i].exchange(nullptr);
+  }
+};
+
+// Documents by doc ID. The first Frozen() docs live in flat arrays, either
+// mapped from a snapshot or built at load time; docs added after that are
+// kept in `added` until the next Freeze(). One writer may Add() while
+// others read; Delete() may come from any thread.
+struct DocTable {
+  struct Article {
+    std::string content;
+    double w;
+    int64_t rowid;
+  };
+
+  Array<double> norms;
+  Array<int64_t> rowids;
+  Array<uint64_t> offsets;  // Frozen() + 1 entries into `text`
+  Array<char> text;
+  AppendOnly<Article> added;
+  AtomicBitset deleted;
+
+  size_t Frozen() const { return norms.size(); }
+  size_t size() const { return Frozen() + added.size(); }
+
+  std::string_view Content(ArticleID i) const {
+    if (i >= Frozen()) return added[i - Frozen()].content;
+    return {text.data() + offsets[i], offsets[i + 1] - offsets[i]};
+  }
+  double Norm(ArticleID i) const {
+    return i < Frozen() ? norms[i] : added[i - Frozen()].w;
+  }
+  int64_t RowID(ArticleID i) const {
+    return i < Frozen() ? rowids[i] : added[i - Frozen()].rowid;
+  }
+  bool Deleted(ArticleID i) const { return deleted.Test(i); }
+
+  void Add(Article art) { added.push_back(std::move(art)); }
+  void Delete(ArticleID i) { deleted.Set(i); }
+
+  // Moves `added` into the flat arrays.
+  void Freeze() {
+    std::vector<double> norms(this->norms.begin(), this->norms.end());
+    std::vector<int64_t> rowids(this->rowids.begin(), this->rowids.end());
+    std::vector<uint64_t> offsets(this->offsets.begin(), this->offsets.end());
+    std::vector<char> text(this->text.begin(), this->text.end());
+    if (offsets.empty()) offsets.push_back(0);
+    for (size_t i = 0; i < added.size(); ++i) {
+      auto const& art = added[i];
+      norms.push_back(art.w);
+      rowids.push_back(art.rowid);
+      text.insert(text.end(), art.content.begin(), art.content.end());
+      offsets.push_back(text.size());
+    }
+    added.clear();
+    this->norms = std::move(norms);
+    this->rowids = std::move(rowids);
+    this->offsets = std::move(offsets);
+    this->text = std::move(text);
+  }
+};
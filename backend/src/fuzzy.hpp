@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Words shorter than this many characters are not expanded at all, and
+// words shorter than FUZZY_TWO_EDITS only within one edit.
+const size_t FUZZY_MIN_RUNES = 2;
+const size_t FUZZY_TWO_EDITS = 6;
+const size_t FUZZY_MAX_TERMS = 4;
+// Automaton steps one expansion may take before giving up on the rest of
+// the dictionary.
+const size_t FUZZY_STEPS = 20000;
+const double FUZZY_PENALTY = 0.5;  // weight factor per edit
+
+// Decodes the UTF-8 character at s[i] and moves i past it. A byte that
+// does not start a valid character is a rune of its own, above the
+// Unicode range.
+inline uint32_t NextRune(std::string_view s, size_t& i) {
+  auto b = (uint8_t)s[i];
+  int n = b < 0x80        ? 0
+          : b >> 5 == 6   ? 1
+          : b >> 4 == 14  ? 2
+          : b >> 3 == 30  ? 3
+                          : -1;
+  if (n == 0) return s[i++];
+  uint32_t invalid = 0x110000 + b;
+  if (n < 0 || i + n >= s.size()) return ++i, invalid;
+  uint32_t r = b & (0x3f >> n);
+  for (int k = 1; k <= n; ++k) {
+    auto c = (uint8_t)s[i + k];
+    if ((c & 0xC0) != 0x80) return ++i, invalid;
+    r = r << 6 | (c & 0x3f);
+  }
+  i += n + 1;
+  return r;
+}
+
+inline std::vector<uint32_t> Runes(std::string_view s) {
+  std::vector<uint32_t> runes;
+  for (size_t i = 0; i < s.size();) runes.push_back(NextRune(s, i));
+  return runes;
+}
+
+// Levenshtein automaton over characters for `word` and distance
+// `maxDist`, simulated a row of the edit distance table at a time: a state
+// is the distances from the input so far to each prefix of the word.
+struct Levenshtein {
+  std::vector<uint32_t> word;
+  uint32_t maxDist;
+
+  std::vector<uint32_t> Start() const {
+    std::vector<uint32_t> row(word.size() + 1);
+    for (size_t i = 0; i < row.size(); ++i) row[i] = i;
+    return row;
+  }
+  std::vector<uint32_t> Step(std::vector<uint32_t> const& row,
+                             uint32_t rune) const {
+    std::vector<uint32_t> next(row.size());
+    next[0] = row[0] + 1;
+    for (size_t i = 1; i < row.size(); ++i)
+      next[i] = std::min({next[i - 1] + 1, row[i] + 1,
+                          row[i - 1] + (word[i - 1] != rune)});
+    return next;
+  }
+  bool CanMatch(std::vector<uint32_t> const& row) const {
+    return *std::min_element(row.begin(), row.end()) <= maxDist;
+  }
+  uint32_t Distance(std::vector<uint32_t> const& row) const {
+    return row.back();
+  }
+};
+
+// The terms of the sorted `terms` within the automaton's distance, as
+// {index, distance}. The sorted list is walked as the trie it spells: a
+// group of terms sharing a prefix is entered only while the automaton can
+// still accept, and skipped by binary search otherwise. Stops after
+// FUZZY_STEPS automaton steps.
+template <class Terms>
+std::vector<std::pair<size_t, uint32_t>> FuzzyMatches(
+    Terms const& terms, Levenshtein const& lev) {
+  std::vector<std::pair<size_t, uint32_t>> out;
+  size_t steps = 0;
+  auto groupEnd = [&](size_t lo, size_t hi, std::string_view prefix) {
+    return std::partition_point(
+               terms.begin() + lo, terms.begin() + hi,
+               [&](auto const& t) {
+                 return std::string_view(t).substr(0, prefix.size()) == prefix;
+               }) -
+           terms.begin();
+  };
+  // terms[lo, hi) all start with the first `depth` bytes of terms[lo].
+  auto walk = [&](auto& self, size_t lo, size_t hi, size_t depth,
+                  std::vector<uint32_t> const& row) -> void {
+    if (std::string_view(terms[lo]).size() == depth) {
+      uint32_t d = lev.Distance(row);
+      if (d <= lev.maxDist) out.push_back({lo, d});
+      ++lo;
+    }
+    while (lo < hi && steps < FUZZY_STEPS) {
+      std::string_view t = terms[lo];
+      size_t end = depth;
+      uint32_t rune = NextRune(t, end);
+      size_t next = groupEnd(lo, hi, t.substr(0, end));
+      auto child = lev.Step(row, rune);
+      ++steps;
+      if (lev.CanMatch(child)) self(self, lo, next, end, child);
+      lo = next;
+    }
+  };
+  if (!terms.empty()) walk(walk, 0, terms.size(), 0, lev.Start());
+  return out;
+}
@@ -0,0 +1,46 @@
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+
+#include "corpus.hpp"
+#include "pool.hpp"
+
+const uint64_t CORPUS_DIR_DOCS = 10000;
+
+// Writes a synthetic corpus (see corpus.hpp) as one file per doc, named by
+// doc number, for `indexer --ingest folder` to load. Docs are spread over
+// subdirectories of CORPUS_DIR_DOCS each, folder/000000/0000000000.txt and
+// on, so no one directory grows to the size of a large corpus.
+//   gen_corpus folder docs [seed]
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "usage: gen_corpus folder docs [seed]\n";
+    return 1;
+  }
+  std::filesystem::path folder = argv[1];
+  uint64_t docs = std::strtoull(argv[2], 0, 10);
+  uint64_t seed = argc > 3 ? std::strtoull(argv[3], 0, 10) : CORPUS_SEED;
+  auto dir = [&](uint64_t i) {
+    char name[32];
+    snprintf(name, sizeof name, "%06llu",
+             (unsigned long long)(i / CORPUS_DIR_DOCS));
+    return folder / name;
+  };
+  std::filesystem::create_directories(folder);
+  for (uint64_t i = 0; i < docs; i += CORPUS_DIR_DOCS)
+    std::filesystem::create_directories(dir(i));
+  Corpus corpus(LoadDictWords(), seed);
+
+  WorkStealingPool pool;
+  size_t chunks = std::min<uint64_t>(docs, pool.size() * 16);
+  pool.ParallelFor(chunks, [&](size_t c) {
+    char name[32];
+    for (uint64_t i = docs * c / chunks; i < docs * (c + 1) / chunks; ++i) {
+      snprintf(name, sizeof name, "%010llu.txt", (unsigned long long)i);
+      std::ofstream(dir(i) / name, std::ios::binary) << corpus.Doc(i);
+    }
+  });
+  std::cerr << "Wrote " << docs << " docs to " << folder << " (seed " << seed
+            << ", " << corpus.words.size() << " dictionary words)\n";
+  return 0;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "postings.hpp"
+
+// The same postings as a PostingStore, ordered for score-at-a-time
+// evaluation: each term's postings are grouped into runs of equal BM25
+// impact, highest impact first, and each run lists its doc IDs ascending
+// as varint gaps (the first from 0). Term t owns runs [terms[t],
+// terms[t + 1]).
+struct ImpactStore {
+  struct Run {
+    uint64_t offset;
+    uint32_t count;
+    uint32_t impact;
+  };
+  static_assert(std::has_unique_object_representations_v<Run>);
+
+  Array<uint8_t> data;
+  Array<Run> runs;
+  Array<uint32_t> terms;
+
+  size_t MemoryUsage() const {
+    return sizeof(*this) + data.Bytes() + runs.Bytes() + terms.Bytes();
+  }
+};
+
+// Regroups every term of `postings` by impact.
+inline ImpactStore BuildImpactOrder(PostingStore const& postings) {
+  std::vector<uint8_t> data;
+  std::vector<ImpactStore::Run> runs;
+  std::vector<uint32_t> terms;
+  std::vector<std::vector<ArticleID>> byImpact(256);
+  for (uint32_t t = 0; t < postings.terms.size(); ++t) {
+    terms.push_back(runs.size());
+    for (PostingCursor c(postings, t); c.Doc() != END_OF_LIST; c.Next())
+      byImpact[c.Impact()].push_back(c.Doc());
+    for (int impact = 255; impact > 0; --impact) {
+      auto& docs = byImpact[impact];
+      if (docs.empty()) continue;
+      runs.push_back({data.size(), (uint32_t)docs.size(), (uint32_t)impact});
+      for (size_t i = 0; i < docs.size(); ++i)
+        PutVarint(data, docs[i] - (i ? docs[i - 1] : 0));
+      docs.clear();
+    }
+  }
+  terms.push_back(runs.size());
+  ImpactStore store;
+  store.data = std::move(data);
+  store.runs = std::move(runs);
+  store.terms = std::move(terms);
+  return store;
+}
+
+// Limits on one anytime evaluation: it stops once either is used up.
+struct AnytimeBudget {
+  size_t postings;
+  std::chrono::microseconds time;
+};
+
+// Dense accumulator arrays, one per doc, shared by every query: at most
+// `limit` exist at once, so memory is limit * corpus size however many
+// threads serve searches. Take waits while all are out. Arrays come back
+// all zero and are grown only when the corpus has.
+struct AccumulatorPool {
+  using Accumulators = std::vector<uint32_t>;
+
+  std::mutex mutex;
+  std::condition_variable returned;
+  std::vector<Accumulators> free;
+  size_t limit, out = 0;
+
+  explicit AccumulatorPool(size_t limit) : limit(std::max<size_t>(1, limit)) {}
+
+  Accumulators Take(size_t docs) {
+    Accumulators acc;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      returned.wait(lock, [&] { return !free.empty() || out < limit; });
+      ++out;
+      if (!free.empty()) {
+        acc = std::move(free.back());
+        free.pop_back();
+      }
+    }
+    if (acc.size() < docs) acc.resize(docs);
+    return acc;
+  }
+
+  void Return(Accumulators acc) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free.push_back(std::move(acc));
+      --out;
+    }
+    returned.notify_one();
+  }
+};
+
+// Score-at-a-time evaluation (as in JASS) into dense accumulators. The
+// runs of all query terms are taken in order of impact times query count,
+// so the postings worth most come first; stopping early leaves the
+// scores of the docs so far short by at most what was not read. The
+// accumulators are borrowed from a pool, and a ranker clears the ones it
+// touched before handing them back, so a query costs what it reads, not
+// the corpus size.
+struct AnytimeRanker {
+  // How many postings go by between clock checks.
+  static const size_t CHECK_EVERY = 1024;
+
+  struct Pending {
+    ImpactStore const* store;
+    ImpactStore::Run run;
+    uint32_t weight;  // impact * query count
+  };
+
+  std::vector<Pending> runs;
+  AccumulatorPool& pool;
+  AccumulatorPool::Accumulators acc;
+  std::vector<ArticleID> touched;
+  size_t processed = 0;
+  bool complete = true;
+
+  AnytimeRanker(AccumulatorPool& pool, size_t docs)
+      : pool(pool), acc(pool.Take(docs)) {}
+  ~AnytimeRanker() {
+    for (auto doc : touched) acc[doc] = 0;
+    pool.Return(std::move(acc));
+  }
+  AnytimeRanker(AnytimeRanker const&) = delete;
+  AnytimeRanker& operator=(AnytimeRanker const&) = delete;
+
+  // Queues the runs of term `t` of `store`.
+  void Add(ImpactStore const& store, uint32_t t, uint32_t count) {
+    for (uint32_t r = store.terms[t]; r < store.terms[t + 1]; ++r)
+      runs.push_back({&store, store.runs[r], store.runs[r].impact * count});
+  }
+
+  void Run(AnytimeBudget budget) {
+    std::stable_sort(runs.begin(), runs.end(), [](auto& a, auto& b) {
+      return a.weight > b.weight;
+    });
+    auto deadline = std::chrono::steady_clock::now() + budget.time;
+    size_t nextCheck = CHECK_EVERY;
+    for (auto const& [store, run, weight] : runs) {
+      uint8_t const* p = store->data.data() + run.offset;
+      ArticleID doc = 0;
+      for (uint32_t i = 0; i < run.count; ++i) {
+        if (processed == budget.postings ||
+            (processed == nextCheck &&
+             std::chrono::steady_clock::now() > deadline)) {
+          complete = false;
+          return;
+        }
+        if (processed == nextCheck) nextCheck += CHECK_EVERY;
+        ++processed;
+        doc += GetVarint(p);
+        if (!acc[doc]) touched.push_back(doc);
+        acc[doc] += weight;
+      }
+    }
+  }
+};
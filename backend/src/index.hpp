@@ -0,0 +1,90 @@
+#pragma once
+
+#include <optional>
+#include <unordered_map>
+
+#include "dictionary.hpp"
+#include "impact.hpp"
+#include "postings.hpp"
+
+// keyword -> term ID (TermDict) -> posting list (postings.terms[term ID]),
+// also kept in impact order (impacts.terms[term ID]), with the BM25
+// parameters its impacts were computed with.
+struct InvertedIndex {
+  TermDict dict;
+  PostingStore postings;
+  ImpactStore impacts;
+  Bm25 bm25;
+
+  std::optional<PostingCursor> Query(std::string_view word) const {
+    auto id = dict.Find(word);
+    if (id < 0) return std::nullopt;
+    return PostingCursor(postings, id);
+  }
+
+  size_t MemoryUsage() const {
+    return dict.MemoryUsage() + postings.MemoryUsage() +
+           impacts.MemoryUsage();
+  }
+};
+
+// Doc length for BM25: how many keyword occurrences the doc has.
+template <class Terms>
+uint32_t DocLength(Terms const& terms) {
+  uint32_t n = 0;
+  for (auto const& t : terms) n += std::max<size_t>(1, t.positions.size());
+  return n;
+}
+
+struct IndexBuilder {
+  struct Entry {
+    PostingList list;
+    std::vector<Positions> positions;
+  };
+  std::unordered_map<std::string, Entry> terms;
+  std::unordered_map<ArticleID, uint32_t> lengths;
+
+  // Docs must come in doc ID order.
+  void Insert(std::string const& word, Posting art, Positions positions = {}) {
+    lengths[art.first] += std::max<size_t>(1, positions.size());
+    auto& entry = terms[word];
+    entry.list.push_back(art);
+    entry.positions.push_back(std::move(positions));
+  }
+
+  // Over the docs inserted so far; BM25_DEFAULT_LENGTH if there are none.
+  double AverageLength() const {
+    if (lengths.empty()) return BM25_DEFAULT_LENGTH;
+    double total = 0;
+    for (auto [_, n] : lengths) total += n;
+    return total / lengths.size();
+  }
+
+  InvertedIndex Build(NormFn const& norm, Bm25 const& bm25) {
+    std::vector<std::string> words;
+    words.reserve(terms.size());
+    for (auto const& [word, _] : terms) words.push_back(word);
+    std::sort(words.begin(), words.end());
+
+    InvertedIndex index;
+    index.dict.Build(words);
+    index.bm25 = bm25;
+    PostingWriter writer;
+    std::vector<uint8_t> impacts;
+    for (auto const& word : words) {
+      auto const& entry = terms[word];
+      impacts.clear();
+      for (size_t i = 0; i < entry.list.size(); ++i) {
+        auto [doc, w] = entry.list[i];
+        impacts.push_back(
+            bm25.Impact(w, entry.positions[i].size(), lengths[doc]));
+      }
+      writer.Append(entry.list, norm, impacts, entry.positions);
+    }
+    index.postings = writer.Finish();
+    index.impacts = BuildImpactOrder(index.postings);
+    terms.clear();
+    lengths.clear();
+    return index;
+  }
+};
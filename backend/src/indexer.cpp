@@ -0,0 +1,119 @@
+#include <chrono>
+#include <random>
+
+#include "database.hpp"
+#include "reorder.hpp"
+
+const size_t SAMPLE_QUERIES = 1000;
+const size_t SAMPLE_TERMS = 3;
+// Timed passes over the sample queries, after one untimed to warm up.
+const size_t SAMPLE_PASSES = 7;
+
+// Queries of up to SAMPLE_TERMS terms of random docs, as term IDs.
+std::vector<std::vector<uint32_t>> SampleQueries(
+    std::vector<std::vector<uint32_t>> const& fwd) {
+  std::mt19937 rng(1);
+  std::vector<std::vector<uint32_t>> queries;
+  for (size_t i = 0; fwd.size() && i < SAMPLE_QUERIES; ++i) {
+    auto terms = fwd[rng() % fwd.size()];
+    std::shuffle(terms.begin(), terms.end(), rng);
+    terms.resize(std::min(terms.size(), SAMPLE_TERMS));
+    if (!terms.empty()) queries.push_back(std::move(terms));
+  }
+  return queries;
+}
+
+// Microseconds per query for WAND over the sample queries, the median of
+// SAMPLE_PASSES passes.
+double TimeQueries(InvertedIndex const& index, DocTable const& docs,
+                   std::vector<std::vector<uint32_t>> const& queries) {
+  if (queries.empty()) return 0;
+  std::vector<double> passes;
+  for (size_t pass = 0; pass <= SAMPLE_PASSES; ++pass) {
+    auto start = std::chrono::steady_clock::now();
+    for (auto const& query : queries) {
+      std::vector<QueryTerm> terms;
+      for (auto t : query)
+        terms.push_back({PostingCursor(index.postings, t), 1});
+      TopK top(RESULTS);
+      Wand(std::move(terms), top,
+           CosineScoring{[&](ArticleID i) { return docs.Norm(i); }},
+           [](ArticleID) { return false; });
+    }
+    std::chrono::duration<double, std::micro> took =
+        std::chrono::steady_clock::now() - start;
+    if (pass) passes.push_back(took.count() / queries.size());
+  }
+  std::nth_element(passes.begin(), passes.begin() + passes.size() / 2,
+                   passes.end());
+  return passes[passes.size() / 2];
+}
+
+// Builds an index snapshot from db.db for the server to map at startup.
+// Docs are renumbered by recursive graph bisection first, so similar docs
+// get nearby IDs.
+//   indexer [output]          write a snapshot (default index.petal)
+//   indexer --keep-order [output]
+//                             write a snapshot in row order
+//   indexer --verify [file]   check every section checksum of a snapshot
+//   indexer --ingest folder [output]
+//                             bulk load the files in folder into db.db, then
+//                             write a snapshot of it all
+//   indexer --shard s/N [--keep-order] [output]
+//                             write the snapshot of the rows whose rowid is s
+//                             modulo N (default index.s-of-N.petal)
+int main(int argc, char **argv) {
+  FlushLogOnCrash();
+  InvertedIndex index;
+  DocTable docs;
+  if (argc > 2 && std::string(argv[1]) == "--ingest") {
+    // Only into SQLite; the snapshot is built from there below.
+    Engine::IngestFolder(Jieba(), argv[2], std::thread::hardware_concurrency(),
+                         Engine::InsertBatch);
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc > 1 && std::string(argv[1]) == "--verify") {
+    std::string path = argc > 2 ? argv[2] : SNAPSHOT_PATH;
+    try {
+      ReadSnapshot(path, index, docs, true);
+    } catch (std::exception const& e) {
+      std::cerr << e.what() << '\n';
+      return 1;
+    }
+    std::cerr << path << ": ok, " << docs.size() << " docs, "
+              << index.dict.size << " terms\n";
+    return 0;
+  }
+  RowShard part;
+  if (argc > 2 && std::string(argv[1]) == "--shard") {
+    part = RowShard::Parse(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
+  bool reorder = true;
+  if (argc > 1 && std::string(argv[1]) == "--keep-order") {
+    reorder = false;
+    argv += 1;
+    argc -= 1;
+  }
+
+  std::string path = argc > 1 ? argv[1] : part.SnapshotPath();
+  LoadDatabase(index, docs, part);
+  if (reorder) {
+    auto fwd = ForwardIndex(index.postings, docs.size());
+    auto queries = SampleQueries(fwd);
+    double bits = DocIdBits(index.postings);
+    double micros = TimeQueries(index, docs, queries);
+    Relabel(index, docs, Bisection(fwd, index.postings.terms.size()).order);
+    std::cerr << "Reordered: doc ID bits/posting " << bits << " -> "
+              << DocIdBits(index.postings) << ", WAND us/query " << micros
+              << " -> " << TimeQueries(index, docs, queries) << " over "
+              << queries.size() << " sample queries\n";
+  }
+  WriteSnapshot(path, index, docs);
+  std::cerr << "Wrote " << path << ": " << docs.size() << " docs, "
+            << index.dict.size << " terms, " << index.postings.Postings()
+            << " postings\n";
+  return 0;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.hpp"
+
+const size_t INGEST_QUEUE = 1024;
+const size_t INGEST_BATCH = 4096;
+
+// Bounded queue between pipeline stages. Push() blocks while full; Pop()
+// blocks while empty and returns nullopt once closed and drained. Once
+// closed, Push() drops what it is given rather than wait, so producers
+// cannot hang on a consumer that has given up.
+template <class T>
+struct Channel {
+  std::deque<T> items;
+  size_t capacity;
+  bool closed = false;
+  std::mutex mutex;
+  std::condition_variable notFull, notEmpty;
+
+  explicit Channel(size_t capacity = INGEST_QUEUE) : capacity(capacity) {}
+
+  void Push(T x) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [&] { return items.size() < capacity || closed; });
+    if (closed) return;
+    items.push_back(std::move(x));
+    notEmpty.notify_one();
+  }
+
+  std::optional<T> Pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+    if (items.empty()) return std::nullopt;
+    T x = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return x;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+};
+
+// Time the threads of one stage spent working, as opposed to waiting on
+// its channels.
+struct Stage {
+  std::string name;
+  size_t threads;
+  std::atomic<uint64_t> busyNs{0};
+
+  Stage(std::string name, size_t threads)
+      : name(std::move(name)), threads(threads) {}
+
+  template <class F>
+  auto Time(F&& f) {
+    auto start = std::chrono::steady_clock::now();
+    struct Add {
+      Stage* stage;
+      std::chrono::steady_clock::time_point start;
+      ~Add() {
+        stage->busyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+      }
+    } add{this, start};
+    return f();
+  }
+
+  double Utilization(double seconds) const {
+    return busyNs / 1e9 / seconds / threads;
+  }
+};
+
+inline std::string ReadFile(std::filesystem::path const& path) {
+  std::ifstream ifs(path, std::ios::binary);
+  std::string s(std::filesystem::file_size(path), '\0');
+  ifs.read(s.data(), s.size());
+  s.resize(ifs.gcount());
+  return s;
+}
+
+inline void ReportIngest(size_t docs, double seconds,
+                         std::vector<Stage const*> const& stages) {
+  LOG(INFO, "Ingested {} docs in {}s ({} docs/sec)", docs, seconds,
+      docs / std::max(seconds, 1e-9));
+  for (auto stage : stages)
+    LOG(INFO, "  {}: {} threads, {}% busy", stage->name, stage->threads,
+        100 * stage->Utilization(seconds));
+}
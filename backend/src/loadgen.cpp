@@ -0,0 +1,153 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../third_party/httplib.h"
+#include "../third_party/json.hpp"
+#include "metrics.hpp"
+
+const size_t LOADGEN_CONCURRENCY = 8;
+// A request sent this long after it was due counts as late.
+const std::chrono::milliseconds LOADGEN_LATE(1);
+// Above this fraction of late requests the sender could not keep up with
+// its own schedule, and the service times hide part of the latency.
+const double LOADGEN_LATE_FRACTION = 0.01;
+
+using Clock = std::chrono::steady_clock;
+
+struct Logged {
+  int64_t ts;  // microseconds
+  std::string path;
+};
+
+std::vector<Logged> ReadLog(std::string const& file) {
+  std::ifstream in(file);
+  if (!in) throw std::runtime_error("cannot open " + file);
+  std::vector<Logged> log;
+  for (std::string line; std::getline(in, line);) {
+    auto j = nlohmann::json::parse(line, nullptr, false);
+    if (j.is_discarded() || !j.is_object()) continue;
+    using httplib::detail::encode_query_param;
+    log.push_back(
+        {j.value("ts", (int64_t)0),
+         "/search?sentence=" + encode_query_param(j.value("sentence", "")) +
+             "&mode=" + encode_query_param(j.value("mode", "")) +
+             "&scoring=" + encode_query_param(j.value("scoring", "")) +
+             "&snippet_length=" +
+             std::to_string(j.value("snippet_length", (size_t)0))});
+  }
+  return log;
+}
+
+// Replays a query log written by `main --query-log` against a server.
+//   loadgen log.jsonl [--host host:port] [--concurrency N] [--qps R]
+//                     [--requests N] [--closed]
+// Open loop (the default): request k is due k / R seconds in, or, without
+// --qps, as far in as it was in the log; whichever connection is free
+// sends it once due. Closed loop: each connection sends its next request
+// when the last one is answered, and, with --qps, not before it is due at
+// R / N per connection. The log is cycled through to make up --requests.
+//
+// Latency counts from when a request was due, service time from when it
+// was sent. They differ when requests wait for a free connection, which a
+// closed-loop tester would not see (coordinated omission); when too many
+// requests go out late that is reported.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "usage: loadgen log.jsonl [--host host:port] "
+                 "[--concurrency N] [--qps R] [--requests N] [--closed]\n";
+    return 1;
+  }
+  std::string host = "localhost:8848";
+  size_t concurrency = LOADGEN_CONCURRENCY, requests = 0;
+  double qps = 0;
+  bool closed = false;
+  for (int i = 2; i < argc; ++i) {
+    std::string flag = argv[i];
+    if (flag == "--closed") {
+      closed = true;
+      continue;
+    }
+    if (i + 1 == argc) break;
+    std::string value = argv[++i];
+    if (flag == "--host") host = value;
+    if (flag == "--concurrency")
+      concurrency = std::max(1, std::atoi(value.c_str()));
+    if (flag == "--qps") qps = std::atof(value.c_str());
+    if (flag == "--requests") requests = std::strtoull(value.c_str(), 0, 10);
+  }
+  auto log = ReadLog(argv[1]);
+  if (log.empty()) {
+    std::cerr << "no queries in " << argv[1] << '\n';
+    return 1;
+  }
+  // Replaying the log's own spacing only covers one pass over it.
+  if (!requests || (!closed && qps <= 0))
+    requests = requests ? std::min(requests, log.size()) : log.size();
+  bool scheduled = qps > 0 || !closed;
+  auto due = [&](size_t k) {
+    if (qps > 0) return std::chrono::nanoseconds((int64_t)(k * 1e9 / qps));
+    return std::chrono::nanoseconds((log[k].ts - log[0].ts) * 1000);
+  };
+
+  auto latency = std::make_unique<Histogram>();
+  auto service = std::make_unique<Histogram>();
+  Counter errors, late;
+  std::atomic<int64_t> maxLag{0};
+  std::atomic<size_t> next{0};
+  auto start = Clock::now() + std::chrono::milliseconds(10);
+  auto send = [&](httplib::Client& cli, size_t k) {
+    auto at = scheduled ? start + due(k) : Clock::now();
+    std::this_thread::sleep_until(at);
+    auto sent = Clock::now();
+    auto res = cli.Get(log[k % log.size()].path.c_str());
+    auto done = Clock::now();
+    if (!res || res->status != 200) errors.Add(1);
+    auto ns = [](auto d) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    };
+    latency->Record(ns(done - at));
+    service->Record(ns(done - sent));
+    if (sent - at > LOADGEN_LATE) late.Add(1);
+    int64_t lag = ns(sent - at), m = maxLag.load();
+    while (lag > m && !maxLag.compare_exchange_weak(m, lag)) {
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < concurrency; ++w)
+    threads.emplace_back([&, w] {
+      httplib::Client cli(host.c_str());
+      cli.set_keep_alive(true);
+      if (closed && qps > 0)
+        for (size_t k = w; k < requests; k += concurrency) send(cli, k);
+      else
+        for (size_t k; (k = next++) < requests;) send(cli, k);
+    });
+  for (auto& t : threads) t.join();
+  std::chrono::duration<double> took = Clock::now() - start;
+
+  auto ms = [](uint64_t ns) { return ns / 1e6; };
+  printf("%s loop, %zu connections, %zu requests in %.2fs: %.1f req/s, "
+         "%llu errors\n",
+         closed ? "closed" : "open", concurrency, requests, took.count(),
+         requests / took.count(), (unsigned long long)errors.Value());
+  for (auto [name, h] : {std::pair{"latency", latency.get()},
+                         std::pair{"service", service.get()}})
+    printf("%-8s p50 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms\n", name,
+           ms(h->Quantile(0.5)), ms(h->Quantile(0.99)),
+           ms(h->Quantile(0.999)), ms(h->Quantile(1)));
+  if (!scheduled) {
+    printf("unscheduled closed loop: latency is service time; pass --qps to "
+           "measure it against an arrival rate\n");
+  } else if (late.Value() > LOADGEN_LATE_FRACTION * requests) {
+    printf("coordinated omission: %llu of %zu requests went out more than "
+           "%lldms late (up to %.3fms); service times understate latency, "
+           "go by the latency line or add connections\n",
+           (unsigned long long)late.Value(), requests,
+           (long long)LOADGEN_LATE.count(), ms(maxLag.load()));
+  }
+  return errors.Value() ? 2 : 0;
+}
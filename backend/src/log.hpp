@@ -0,0 +1,382 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "metrics.hpp"
+
+// Logging off the request path:
+//   LOG(INFO, "shard {} did not answer in {}ms", host, timeout);
+// A call below the logger's level costs a load and a compare. Otherwise
+// it copies its arguments, unformatted, into a slot of its own thread's
+// ring buffer, and a background thread drains the rings every
+// LOG_DRAIN_INTERVAL, formats the records in time order and writes them
+// out. WARN and ERROR records are written out before the call returns,
+// with whatever was logged before them, so a crash right after one does
+// not lose it. A full ring drops the record and counts it in /metrics
+// rather than wait. Each call site is also held to LOG_SITE_RATE records
+// a second; how many it skipped shows on its next line.
+//
+// `{}` in the format stands for the next argument: an integer, a floating
+// point number, a string, or a range of strings or of keywords (their
+// words). Strings are cut short where the record runs out of room.
+const size_t LOG_RING = 1024;  // records per thread
+const size_t LOG_PAYLOAD = 232;
+const uint32_t LOG_SITE_RATE = 1000;
+const std::chrono::milliseconds LOG_DRAIN_INTERVAL(5);
+
+enum class LogLevel { DEBUG, INFO, WARN, ERROR };
+const char* const LOG_LEVEL_NAMES[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+inline LogLevel LogLevelNamed(std::string_view name) {
+  for (int l = 0; l < 4; ++l)
+    if (std::equal(name.begin(), name.end(), LOG_LEVEL_NAMES[l],
+                   LOG_LEVEL_NAMES[l] + strlen(LOG_LEVEL_NAMES[l]),
+                   [](char a, char b) { return toupper(a) == b; }))
+      return LogLevel(l);
+  return LogLevel::INFO;
+}
+
+struct LogSite {
+  LogLevel level;
+  char const* format;
+  char const* file;
+  int line;
+  std::atomic<int64_t> second{0};
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> skipped{0};
+
+  // Whether a record at `ns` keeps within `rate` a second (0 for no
+  // limit), with the number skipped since the last one that did. Sites
+  // logging from several threads share the count, so the limit is loose
+  // at the turn of a second.
+  bool Admit(int64_t ns, uint32_t rate, uint32_t& before) {
+    if (rate) {
+      int64_t s = ns / 1000000000;
+      if (second.load(std::memory_order_relaxed) != s) {
+        second.store(s, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+      }
+      if (count.fetch_add(1, std::memory_order_relaxed) >= rate) {
+        skipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+    before = skipped.load(std::memory_order_relaxed)
+                 ? skipped.exchange(0, std::memory_order_relaxed)
+                 : 0;
+    return true;
+  }
+};
+
+enum LogArg : char {
+  LOG_ARG_INT,
+  LOG_ARG_UINT,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_STRING,
+  LOG_ARG_LIST
+};
+
+struct LogRecord {
+  LogSite const* site;
+  int64_t ns;  // since the epoch
+  uint32_t skipped;
+  uint16_t size;
+  char payload[LOG_PAYLOAD];
+};
+
+// Tagged arguments, a string as its 16-bit length and bytes and a list as
+// its 16-bit count and strings. Once an argument does not fit the rest
+// are left out.
+struct LogEncoder {
+  char* p;
+  char* end;
+
+  bool Room(size_t n) {
+    if (end - p >= (ptrdiff_t)n) return true;
+    p = end;
+    return false;
+  }
+  template <class T>
+  void Fixed(LogArg tag, T v) {
+    if (!Room(1 + sizeof v)) return;
+    *p++ = tag;
+    memcpy(p, &v, sizeof v);
+    p += sizeof v;
+  }
+  void Text(std::string_view s) {
+    size_t n = std::min<size_t>(s.size(), end - p - 2);
+    while (n < s.size() && n && (s[n] & 0xC0) == 0x80) --n;  // UTF-8
+    uint16_t len = n;
+    memcpy(p, &len, 2);
+    memcpy(p + 2, s.data(), n);
+    p += 2 + n;
+  }
+  template <class T>
+  static std::string_view Word(T const& v) {
+    if constexpr (std::is_convertible_v<T const&, std::string_view>)
+      return v;
+    else
+      return v.word;
+  }
+
+  template <class T>
+  void Add(T const& v) {
+    if constexpr (std::is_floating_point_v<T>) {
+      Fixed(LOG_ARG_DOUBLE, (double)v);
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+      Fixed(LOG_ARG_INT, (int64_t)v);
+    } else if constexpr (std::is_integral_v<T>) {
+      Fixed(LOG_ARG_UINT, (uint64_t)v);
+    } else if constexpr (std::is_convertible_v<T const&, std::string_view>) {
+      if (!Room(3)) return;
+      *p++ = LOG_ARG_STRING;
+      Text(v);
+    } else {
+      if (!Room(3)) return;
+      *p++ = LOG_ARG_LIST;
+      char* count = p;
+      p += 2;
+      uint16_t n = 0;
+      for (auto const& e : v) {
+        if (end - p < 2) break;
+        Text(Word(e));
+        ++n;
+      }
+      memcpy(count, &n, 2);
+    }
+  }
+};
+
+// One thread writes a ring, the logger's thread drains it.
+struct LogRing {
+  LogRecord records[LOG_RING];
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  std::atomic<bool> closed{false};  // its thread has exited
+};
+
+struct Logger {
+  std::atomic<LogLevel> level{LogLevel::INFO};
+  std::atomic<uint32_t> siteRate{LOG_SITE_RATE};
+  std::atomic<FILE*> out{stderr};
+
+  std::mutex mutex;  // guards rings and draining them
+  std::vector<std::shared_ptr<LogRing>> rings;
+  std::mutex wakeMutex;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread drainer;
+
+  Logger() : drainer([this] { Loop(); }) {}
+  ~Logger() {
+    {
+      std::lock_guard<std::mutex> lock(wakeMutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    drainer.join();
+  }
+
+  bool Enabled(LogLevel l) const {
+    return l >= level.load(std::memory_order_relaxed);
+  }
+
+  template <class... A>
+  void Write(LogSite& site, A const&... args) {
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                     .count();
+    uint32_t skipped;
+    if (!site.Admit(ns, siteRate.load(std::memory_order_relaxed), skipped))
+      return;
+    LogRing& ring = Ring();
+    uint64_t h = ring.head.load(std::memory_order_relaxed);
+    if (h - ring.tail.load(std::memory_order_acquire) == LOG_RING) {
+      metrics.logDropped.Add(1);
+      if (skipped) site.skipped.fetch_add(skipped, std::memory_order_relaxed);
+      return;
+    }
+    LogRecord& r = ring.records[h % LOG_RING];
+    r.site = &site;
+    r.ns = ns;
+    r.skipped = skipped;
+    LogEncoder e{r.payload, r.payload + LOG_PAYLOAD};
+    (e.Add(args), ...);
+    r.size = e.p - r.payload;
+    ring.head.store(h + 1, std::memory_order_release);
+    if (site.level >= LogLevel::WARN) Drain();
+  }
+
+  // Writes out what was logged before the call, from this thread and any
+  // other.
+  void Flush() { Drain(); }
+  // Flush for a signal handler: gives up rather than wait for the thread
+  // draining, which may be the one that crashed.
+  void TryFlush() {
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (lock) DrainLocked();
+  }
+
+ private:
+  LogRing& Ring() {
+    thread_local struct Owner {
+      std::shared_ptr<LogRing> ring;
+      ~Owner() { ring->closed.store(true, std::memory_order_release); }
+    } owner{Register()};
+    return *owner.ring;
+  }
+  std::shared_ptr<LogRing> Register() {
+    auto ring = std::make_shared<LogRing>();
+    std::lock_guard<std::mutex> lock(mutex);
+    rings.push_back(ring);
+    return ring;
+  }
+
+  static void Format(LogRecord const& r, std::string& text) {
+    char line[128];
+    time_t s = r.ns / 1000000000;
+    tm t;
+    gmtime_r(&s, &t);
+    char const* file = strrchr(r.site->file, '/');
+    snprintf(line, sizeof line,
+             "%04d-%02d-%02dT%02d:%02d:%02d.%06lldZ %-5s %s:%d ",
+             t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min,
+             t.tm_sec, (long long)(r.ns % 1000000000 / 1000),
+             LOG_LEVEL_NAMES[(int)r.site->level],
+             file ? file + 1 : r.site->file, r.site->line);
+    text += line;
+
+    char const* p = r.payload;
+    char const* end = p + r.size;
+    auto text16 = [&](std::string& out) {
+      uint16_t n;
+      memcpy(&n, p, 2);
+      out.append(p + 2, n);
+      p += 2 + n;
+    };
+    for (char const* f = r.site->format; *f; ++f) {
+      if (f[0] != '{' || f[1] != '}') {
+        text += *f;
+        continue;
+      }
+      ++f;
+      if (p == end) continue;
+      switch (*p++) {
+        case LOG_ARG_INT: {
+          int64_t v;
+          memcpy(&v, p, 8);
+          text += std::to_string(v);
+        } break;
+        case LOG_ARG_UINT: {
+          uint64_t v;
+          memcpy(&v, p, 8);
+          text += std::to_string(v);
+        } break;
+        case LOG_ARG_DOUBLE: {
+          double v;
+          memcpy(&v, p, 8);
+          snprintf(line, sizeof line, "%g", v);
+          text += line;
+        } break;
+        case LOG_ARG_STRING:
+          text16(text);
+          continue;
+        case LOG_ARG_LIST: {
+          uint16_t n;
+          memcpy(&n, p, 2);
+          p += 2;
+          text += '[';
+          for (uint16_t i = 0; i < n; ++i) {
+            if (i) text += ", ";
+            text16(text);
+          }
+          text += ']';
+        }
+          continue;
+      }
+      p += 8;
+    }
+    if (r.skipped) text += " (" + std::to_string(r.skipped) + " skipped)";
+    text += '\n';
+  }
+
+  void Drain() {
+    std::lock_guard<std::mutex> lock(mutex);
+    DrainLocked();
+  }
+  void DrainLocked() {
+    std::vector<std::pair<int64_t, std::string>> lines;
+    for (auto it = rings.begin(); it != rings.end();) {
+      LogRing& ring = **it;
+      // Read before head, so a closed ring is dropped only once drained.
+      bool closed = ring.closed.load(std::memory_order_acquire);
+      uint64_t t = ring.tail.load(std::memory_order_relaxed);
+      uint64_t h = ring.head.load(std::memory_order_acquire);
+      for (; t < h; ++t) {
+        LogRecord const& r = ring.records[t % LOG_RING];
+        lines.emplace_back(r.ns, std::string());
+        Format(r, lines.back().second);
+      }
+      ring.tail.store(t, std::memory_order_release);
+      it = closed ? rings.erase(it) : it + 1;
+    }
+    if (lines.empty()) return;
+    std::stable_sort(lines.begin(), lines.end(),
+                     [](auto& a, auto& b) { return a.first < b.first; });
+    std::string text;
+    for (auto& [_, l] : lines) text += l;
+    FILE* f = out.load();
+    fwrite(text.data(), 1, text.size(), f);
+    fflush(f);
+  }
+
+  void Loop() {
+    for (bool stop = false; !stop;) {
+      {
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wake.wait_for(lock, LOG_DRAIN_INTERVAL, [&] { return stopping; });
+        stop = stopping;
+      }
+      Drain();
+    }
+  }
+};
+
+inline Logger logger;
+
+// Writes out what the rings hold when the process dies of a fatal signal,
+// then lets the signal take its course. Best effort: formatting in a
+// signal handler is not async-signal-safe, but the process is lost anyway.
+inline void FlushLogOnCrash() {
+  for (int sig : {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL}) {
+    struct sigaction sa = {};
+    sa.sa_handler = [](int sig) {
+      logger.TryFlush();
+      raise(sig);
+    };
+    sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+    sigaction(sig, &sa, nullptr);
+  }
+}
+
+#define LOG(level, format, ...)                                          \
+  do {                                                                   \
+    static LogSite logSite{LogLevel::level, format, __FILE__, __LINE__}; \
+    if (logger.Enabled(LogLevel::level))                                 \
+      logger.Write(logSite, ##__VA_ARGS__);                              \
+  } while (0)
@@ -1,17 +1,186 @@
+#include <optional>
+
 #include "../third_party/httplib.h"
-#include "database.hpp"
+#include "cluster.hpp"
+#include "querylog.hpp"
+
+std::optional<Engine> db;
+
+// Sends the body with its length, straight from the writer to the socket.
+void SetJson(httplib::Response &res, JsonWriter body) {
+  auto w = std::make_shared<JsonWriter>(std::move(body));
+  res.set_content_provider(
+      w->Size(), "application/json",
+      [w](size_t offset, size_t length, httplib::DataSink &sink) {
+        return metrics.Time(PHASE_SERIALIZE, [&] {
+          return w->Write(offset, length, sink.write);
+        });
+      });
+}
 
+// main [--port N] [--shards N] [--anytime-postings N] [--anytime-us N]
+//      [--fuzzy 0|1] [--shard s/N]
+//   serve the local index; also answers coordinators as a shard. With
+//   --shard, only the rows of db.db whose rowid is s modulo N, from the
+//   snapshot `indexer --shard s/N` writes
+// main --coordinator host:port,host:port,... [--port N] [--timeout ms]
+//   serve searches by fanning them out to shard servers, without fuzzy
+//   expansion
+// Either may add --query-log file [--query-log-rate fraction] to append
+// that fraction of searches (default all) to file for loadgen, and
+// --log-level debug|info|warn|error (default info), and --phase-timing 0
+// to stop timing the phases of searches and ingestion for /metrics.
 int main(int argc, char **argv) {
-  // db.BatchAddEntry("./arts");
+  FlushLogOnCrash();
+  int port = 8848;
+  size_t shards = 0;
+  RowShard part;
+  std::vector<std::string> remotes;
+  int timeout = SHARD_TIMEOUT_MS;
+  bool fuzzy = true;
+  std::string queryLogPath;
+  double queryLogRate = 1;
+  AnytimeBudget anytime{ANYTIME_POSTINGS,
+                        std::chrono::microseconds(ANYTIME_MICROS)};
+  for (int i = 1; i + 1 < argc; ++i) {
+    std::string flag = argv[i], value = argv[++i];
+    if (flag == "--port") port = std::atoi(value.c_str());
+    if (flag == "--shards") shards = std::max(1, std::atoi(value.c_str()));
+    if (flag == "--shard") part = RowShard::Parse(value);
+    if (flag == "--timeout") timeout = std::max(1, std::atoi(value.c_str()));
+    if (flag == "--fuzzy") fuzzy = value != "0";
+    if (flag == "--log-level") logger.level = LogLevelNamed(value);
+    if (flag == "--phase-timing") metrics.timing = value != "0";
+    if (flag == "--query-log") queryLogPath = value;
+    if (flag == "--query-log-rate")
+      queryLogRate = std::clamp(std::atof(value.c_str()), 0.0, 1.0);
+    if (flag == "--anytime-postings")
+      anytime.postings = std::strtoull(value.c_str(), 0, 10);
+    if (flag == "--anytime-us")
+      anytime.time = std::chrono::microseconds(std::atol(value.c_str()));
+    if (flag == "--coordinator")
+      for (size_t at = 0; at < value.size();) {
+        size_t comma = std::min(value.find(',', at), value.size());
+        remotes.push_back(value.substr(at, comma - at));
+        at = comma + 1;
+      }
+  }
+  std::optional<Coordinator> coordinator;
+  if (!remotes.empty()) {
+    coordinator.emplace(remotes);
+    coordinator->timeout = std::chrono::milliseconds(timeout);
+  } else {
+    db.emplace(part);
+    if (shards) db->shards = shards;
+    db->anytime = anytime;
+    db->fuzzy = fuzzy;
+  }
+  std::optional<QueryLog> queryLog;
+  if (!queryLogPath.empty()) queryLog.emplace(queryLogPath, queryLogRate);
+  // db->BatchAddEntry("./arts");
+  auto modeOf = [](std::string const &name) {
+    return name == "exhaustive" ? Engine::Mode::EXHAUSTIVE
+           : name == "anytime"  ? Engine::Mode::ANYTIME
+                                : Engine::Mode::WAND;
+  };
+  // Scoring defaults to cosine, except in anytime mode, which only takes
+  // bm25; asking for cosine there is a 400.
+  auto scoringOf = [](std::string const &name, Engine::Mode mode) {
+    if (name.empty() && mode == Engine::Mode::ANYTIME)
+      return Engine::Scoring::BM25;
+    return name == "bm25" ? Engine::Scoring::BM25 : Engine::Scoring::COSINE;
+  };
   httplib::Server svr;
   svr.Get("/search", [&](httplib::Request const &req, httplib::Response &res) {
     auto sts = req.get_param_value("sentence");
-    std::cerr << sts << '\n';
-    auto j = db.Search(sts);
+    LOG(INFO, "search: {}", sts);
+    auto mode = modeOf(req.get_param_value("mode"));
+    auto scoring = scoringOf(req.get_param_value("scoring"), mode);
     res.set_header("Access-Control-Allow-Origin", "*");
+    try {
+      Engine::CheckScoring(mode, scoring);
+    } catch (std::exception const &e) {
+      res.status = 400;
+      res.set_content(e.what(), "text/plain");
+      return;
+    }
+    size_t snippetLength = 0;
+    if (req.has_param("snippet_length"))
+      snippetLength =
+          std::strtoul(req.get_param_value("snippet_length").c_str(), 0, 10);
+    else if (req.get_param_value("snippet") == "1")
+      snippetLength = SNIPPET_LENGTH;
+    if (queryLog)
+      queryLog->Record(sts, req.get_param_value("mode"),
+                       req.get_param_value("scoring"), snippetLength);
+    auto w = coordinator
+                 ? coordinator->Search(sts, mode, scoring, snippetLength)
+                 : db->Search(sts, mode, scoring, snippetLength);
     res.set_header("Cache-Control", "no-cache");
-    res.set_content(j.dump(), "application/json");
+    SetJson(res, std::move(w));
+  });
+  svr.Get("/doc", [&](httplib::Request const &req, httplib::Response &res) {
+    auto id = req.get_param_value("id");
+    std::optional<JsonWriter> w;
+    if (!id.empty()) {
+      auto i = std::strtoull(id.c_str(), 0, 10);
+      w = coordinator ? coordinator->Document(i) : db->Document(i);
+    }
+    res.set_header("Access-Control-Allow-Origin", "*");
+    if (w) {
+      SetJson(res, std::move(*w));
+    } else {
+      res.status = 404;
+      res.set_content("null", "application/json");
+    }
+  });
+  svr.Get("/metrics", [&](httplib::Request const &, httplib::Response &res) {
+    res.set_content(metrics.Prometheus(), "text/plain; version=0.0.4");
   });
-  svr.listen("0.0.0.0", 8848);
+  if (db) {
+    svr.Get("/suggest", [&](httplib::Request const &req,
+                            httplib::Response &res) {
+      size_t n = SUGGEST_TOP;
+      if (req.has_param("n"))
+        n = std::strtoul(req.get_param_value("n").c_str(), 0, 10);
+      res.set_header("Access-Control-Allow-Origin", "*");
+      SetJson(res, db->Suggest(req.get_param_value("prefix"), n));
+    });
+    svr.Get("/stats", [&](httplib::Request const &, httplib::Response &res) {
+      res.set_content(db->Stats().dump(), "application/json");
+    });
+    svr.Post(SHARD_SEARCH_PATH,
+             [&](httplib::Request const &req, httplib::Response &res) {
+               try {
+                 res.set_content(ServeShardQuery(*db, req.body),
+                                 "application/octet-stream");
+               } catch (std::exception const &e) {
+                 res.status = 400;
+                 res.set_content(e.what(), "text/plain");
+               }
+             });
+    // Body: {"sentences": [...], "mode", "scoring", "snippet_length"}, the
+    // last three as for /search. Responds {"results": [...]} with one
+    // /search response per sentence, in order.
+    svr.Post("/search/batch",
+             [&](httplib::Request const &req, httplib::Response &res) {
+               res.set_header("Access-Control-Allow-Origin", "*");
+               try {
+                 auto body = Json::parse(req.body);
+                 std::vector<std::string> sentences = body.at("sentences");
+                 if (sentences.size() > MAX_BATCH)
+                   throw std::runtime_error("too many sentences");
+                 auto mode = modeOf(body.value("mode", ""));
+                 SetJson(res, db->SearchBatch(
+                                  sentences, mode,
+                                  scoringOf(body.value("scoring", ""), mode),
+                                  body.value("snippet_length", (size_t)0)));
+               } catch (std::exception const &e) {
+                 res.status = 400;
+                 res.set_content(e.what(), "text/plain");
+               }
+             });
+  }
+  svr.listen("0.0.0.0", port);
   return 0;
 }
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// Threads share METRIC_SLOTS cache-line-aligned slots of every counter and
+// histogram, picked once per thread, so recording is a relaxed add to a
+// line no other thread is likely to touch. Reads sum the slots.
+const size_t METRIC_SLOTS = 16;
+
+inline size_t MetricSlot() {
+  static std::atomic<size_t> next{0};
+  thread_local size_t slot = next++ % METRIC_SLOTS;
+  return slot;
+}
+
+struct Counter {
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> n{0};
+  };
+  Slot slots[METRIC_SLOTS];
+
+  void Add(uint64_t v) {
+    slots[MetricSlot()].n.fetch_add(v, std::memory_order_relaxed);
+  }
+  uint64_t Value() const {
+    uint64_t n = 0;
+    for (auto const& s : slots) n += s.n.load(std::memory_order_relaxed);
+    return n;
+  }
+};
+
+// Log-linear histogram of nanoseconds, laid out as in HdrHistogram: values
+// below 2^SUB_BITS have a bucket each, and every power of two above is cut
+// into 2^SUB_BITS buckets, so a bucket is within 1 / 2^SUB_BITS of any
+// value in it. Values from 2^MAX_BITS ns (about 18 minutes) go in the last
+// bucket.
+struct Histogram {
+  static const int SUB_BITS = 3;
+  static const int MAX_BITS = 40;
+  static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> sum{0};
+  };
+  Slot slots[METRIC_SLOTS];
+
+  static int Bucket(uint64_t v) {
+    v = std::min<uint64_t>(v, (1ull << MAX_BITS) - 1);
+    if (v < 1u << SUB_BITS) return v;
+    int e = 63 - __builtin_clzll(v);
+    int mantissa = v >> (e - SUB_BITS) & ((1 << SUB_BITS) - 1);
+    return (e - SUB_BITS + 1) << SUB_BITS | mantissa;
+  }
+  // The largest value in bucket b.
+  static uint64_t Upper(int b) {
+    if (b < 1 << SUB_BITS) return b;
+    int shift = (b >> SUB_BITS) - 1;
+    uint64_t m = (b & ((1 << SUB_BITS) - 1)) | 1 << SUB_BITS;
+    return ((m + 1) << shift) - 1;
+  }
+
+  void Record(uint64_t ns) {
+    auto& s = slots[MetricSlot()];
+    s.counts[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  // Counts summed over the slots, and their total.
+  uint64_t Merge(uint64_t (&counts)[BUCKETS], uint64_t& sum) const {
+    uint64_t n = 0;
+    sum = 0;
+    for (int b = 0; b < BUCKETS; ++b) {
+      counts[b] = 0;
+      for (auto const& s : slots)
+        counts[b] += s.counts[b].load(std::memory_order_relaxed);
+      n += counts[b];
+    }
+    for (auto const& s : slots) sum += s.sum.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  // The upper end of the bucket holding quantile q of the n values
+  // counted in `counts`.
+  static uint64_t Quantile(uint64_t const (&counts)[BUCKETS], uint64_t n,
+                           double q) {
+    if (!n) return 0;
+    uint64_t rank = std::min<uint64_t>(q * n, n - 1), below = 0;
+    int b = 0;
+    while (b < BUCKETS - 1 && below + counts[b] <= rank) below += counts[b++];
+    return Upper(b);
+  }
+  uint64_t Quantile(double q) const {
+    uint64_t counts[BUCKETS], sum;
+    uint64_t n = Merge(counts, sum);
+    return Quantile(counts, n, q);
+  }
+};
+
+// What /metrics reports: the time spent in each phase of a search and of
+// ingestion, and what the searches touched.
+enum Phase : size_t {
+  PHASE_ANALYZE,     // segmenting the query
+  PHASE_FUZZY,       // expanding unknown words
+  PHASE_RANK,        // cache lookup and ranking, broken down into:
+  PHASE_CACHE,       //   looking up a query the result cache misses
+  PHASE_LOOKUP,      //   finding the words' postings and excluded docs
+  PHASE_ACCUMULATE,  //   walking and scoring postings and pending docs
+  PHASE_TOPK,        //   merging and sorting the best hits
+  PHASE_RESULTS,     // snippets and the response's structure
+  PHASE_SERIALIZE,   // escaping and sending the response body
+  // Segmenting a doc, and storing and indexing it: one doc at a time for
+  // AddEntry, and one batch at a time for the write of a bulk load.
+  PHASE_INGEST_SEGMENT,
+  PHASE_INGEST_WRITE,
+  PHASE_COUNT
+};
+const char* const PHASE_NAMES[PHASE_COUNT] = {
+    "analyze",     "fuzzy",           "rank",      "rank_cache",
+    "rank_lookup", "rank_accumulate", "rank_topk", "results",
+    "serialize",   "ingest_segment",  "ingest_write"};
+
+struct Metrics {
+  Histogram phases[PHASE_COUNT];
+  Counter searches, postings, candidates, cacheHits, cacheMisses, ingested;
+  Counter logDropped, queryLogDropped;
+  // Off, phases are neither timed nor recorded; the counters still count.
+  std::atomic<bool> timing{true};
+
+  bool Timing() const { return timing.load(std::memory_order_relaxed); }
+
+  template <class F>
+  auto Time(Phase phase, F&& f) {
+    struct Record {
+      Histogram* h;
+      std::chrono::steady_clock::time_point start;
+      ~Record() {
+        if (!h) return;
+        h->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count());
+      }
+    } record{nullptr, {}};
+    if (Timing()) record = {&phases[phase], std::chrono::steady_clock::now()};
+    return f();
+  }
+
+  // Times phases that follow one another, at one clock read per phase.
+  struct Laps {
+    Metrics& metrics;
+    std::chrono::steady_clock::time_point last;
+
+    void Lap(Phase phase) { Lap(phase, last); }
+    // Records the time since `since`, when an earlier lap ended, for a
+    // phase made up of the laps after it.
+    void Lap(Phase phase, std::chrono::steady_clock::time_point since) {
+      if (!metrics.Timing()) return;
+      auto now = std::chrono::steady_clock::now();
+      metrics.phases[phase].Record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - since)
+              .count());
+      last = now;
+    }
+  };
+  Laps Start() {
+    return {*this, Timing() ? std::chrono::steady_clock::now()
+                            : std::chrono::steady_clock::time_point{}};
+  }
+
+  // Prometheus text format. Histogram buckets are reported at powers of
+  // two from 1us; quantiles come from the full resolution.
+  std::string Prometheus() const {
+    std::string out;
+    char line[256];
+    auto counter = [&](char const* name, char const* help, Counter const& c) {
+      snprintf(line, sizeof line,
+               "# HELP petal_%s %s\n# TYPE petal_%s counter\npetal_%s %llu\n",
+               name, help, name, name, (unsigned long long)c.Value());
+      out += line;
+    };
+    counter("searches_total", "Searches answered.", searches);
+    counter("postings_scanned_total", "Postings decoded while ranking.",
+            postings);
+    counter("candidates_total", "Docs scored while ranking.", candidates);
+    counter("cache_hits_total", "Searches answered from the result cache.",
+            cacheHits);
+    counter("cache_misses_total", "Searches that had to be ranked.",
+            cacheMisses);
+    counter("ingested_docs_total", "Docs added to the index.", ingested);
+    counter("log_dropped_total", "Log records dropped on a full buffer.",
+            logDropped);
+    counter("query_log_dropped_total",
+            "Query log records dropped on a full queue.", queryLogDropped);
+
+    uint64_t counts[Histogram::BUCKETS];
+    out += "# HELP petal_phase_seconds Time spent in each phase.\n"
+           "# TYPE petal_phase_seconds histogram\n";
+    std::string quantiles =
+        "# HELP petal_phase_quantile_seconds Phase time quantiles.\n"
+        "# TYPE petal_phase_quantile_seconds gauge\n";
+    for (size_t p = 0; p < PHASE_COUNT; ++p) {
+      uint64_t sum, n = phases[p].Merge(counts, sum), seen = 0;
+      int b = 0;
+      for (int e = 10; e <= Histogram::MAX_BITS; ++e) {
+        uint64_t le = (1ull << e) - 1;
+        for (; b < Histogram::BUCKETS && Histogram::Upper(b) <= le; ++b)
+          seen += counts[b];
+        snprintf(line, sizeof line,
+                 "petal_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+                 PHASE_NAMES[p], le / 1e9, (unsigned long long)seen);
+        out += line;
+      }
+      snprintf(line, sizeof line,
+               "petal_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n"
+               "petal_phase_seconds_sum{phase=\"%s\"} %g\n"
+               "petal_phase_seconds_count{phase=\"%s\"} %llu\n",
+               PHASE_NAMES[p], (unsigned long long)n, PHASE_NAMES[p],
+               sum / 1e9, PHASE_NAMES[p], (unsigned long long)n);
+      out += line;
+      for (double q : {0.5, 0.99, 0.999}) {
+        snprintf(line, sizeof line,
+                 "petal_phase_quantile_seconds{phase=\"%s\",quantile=\"%g\"} "
+                 "%g\n",
+                 PHASE_NAMES[p], q, Histogram::Quantile(counts, n, q) / 1e9);
+        quantiles += line;
+      }
+    }
+    return out + quantiles;
+  }
+};
+
+inline Metrics metrics;
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads with one task deque each. A worker runs its own
+// newest task first and, when it has none, steals the oldest task of
+// another worker; tasks submitted from outside are dealt round robin.
+struct WorkStealingPool {
+  using Task = std::function<void()>;
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> queued{0}, nextQueue{0};
+  std::mutex idleMutex;
+  std::condition_variable idle;
+  bool stopping = false;
+
+  explicit WorkStealingPool(
+      size_t n = std::max(1u, std::thread::hardware_concurrency())) {
+    for (size_t i = 0; i < n; ++i) queues.push_back(std::make_unique<Queue>());
+    for (size_t i = 0; i < n; ++i) threads.emplace_back([this, i] { Work(i); });
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(idleMutex);
+      stopping = true;
+    }
+    idle.notify_all();
+    for (auto& t : threads) t.join();
+  }
+
+  size_t size() const { return threads.size(); }
+
+  void Submit(Task task) {
+    size_t i = Self() < queues.size() ? Self() : nextQueue++ % queues.size();
+    {
+      std::lock_guard<std::mutex> lock(queues[i]->mutex);
+      queues[i]->tasks.push_back(std::move(task));
+    }
+    ++queued;
+    std::lock_guard<std::mutex> lock(idleMutex);
+    idle.notify_one();
+  }
+
+  // Runs f(0) .. f(n - 1) and returns once all are done. The caller takes
+  // indices too, so it never waits on a busy pool for work of its own.
+  // Each task takes indices until none are left, so one per thread beside
+  // the caller's is enough however large n is. Once none are left the
+  // caller sleeps until the last one taken is done.
+  void ParallelFor(size_t n, std::function<void(size_t)> const& f) {
+    if (!n) return;
+    struct Job {
+      std::atomic<size_t> next{0};
+      size_t done = 0;
+      std::mutex mutex;
+      std::condition_variable finished;
+    };
+    auto job = std::make_shared<Job>();
+    auto run = [job, n, &f] {
+      size_t ran = 0;
+      for (size_t i; (i = job->next++) < n; ++ran) f(i);
+      if (!ran) return;
+      std::lock_guard<std::mutex> lock(job->mutex);
+      if ((job->done += ran) == n) job->finished.notify_one();
+    };
+    for (size_t i = 1; i < std::min(n, size()); ++i) Submit(run);
+    run();
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&] { return job->done == n; });
+  }
+
+ private:
+  static size_t& Self() {
+    thread_local size_t self = SIZE_MAX;
+    return self;
+  }
+
+  bool RunOne(size_t self) {
+    Task task;
+    for (size_t k = 0; k < queues.size() && !task; ++k) {
+      auto& q = *queues[(self + k) % queues.size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (q.tasks.empty()) continue;
+      if (k == 0) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      } else {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+    }
+    if (!task) return false;
+    --queued;
+    task();
+    return true;
+  }
+
+  void Work(size_t i) {
+    Self() = i;
+    while (true) {
+      if (RunOne(i)) continue;
+      std::unique_lock<std::mutex> lock(idleMutex);
+      idle.wait(lock, [&] { return stopping || queued > 0; });
+      if (stopping) return;
+    }
+  }
+};
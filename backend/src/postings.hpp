@@ -0,0 +1,342 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+#include "coding.hpp"
+#include "storage.hpp"
+
+using ArticleID = uint32_t;
+using Posting = std::pair<ArticleID, double>;
+using PostingList = std::vector<Posting>;
+using Positions = std::vector<uint32_t>;  // character offsets, ascending
+using NormFn = std::function<double(ArticleID)>;
+
+const int POSTING_BLOCK = 128;
+const ArticleID END_OF_LIST = UINT32_MAX;
+
+const double BM25_K1 = 1.2;
+const double BM25_B = 0.75;
+// Impacts are quantized on one scale for every term and segment, so that
+// their sums compare across them: IDFs from jieba's dictionary stay
+// below BM25_MAX_IDF, and a posting scores at most idf * (k1 + 1).
+const double BM25_MAX_IDF = 16;
+const double BM25_QUANTUM = BM25_MAX_IDF * (BM25_K1 + 1) / 255;
+// Average doc length assumed for an index built over no docs at all.
+const double BM25_DEFAULT_LENGTH = 100;
+
+// BM25 with the collection's average doc length, counted in keyword
+// occurrences like the doc lengths themselves. A posting's score only
+// depends on the posting and its doc, so it is computed once at index time
+// and stored quantized as its impact.
+struct Bm25 {
+  double avgLength = BM25_DEFAULT_LENGTH;
+
+  // `tf` may be a weighted sum of the term's counts in several fields,
+  // and `length` of the fields' lengths, for BM25F.
+  double Score(double tf, double idf, double length) const {
+    double norm = BM25_K1 * (1 - BM25_B + BM25_B * length / avgLength);
+    return idf * tf * (BM25_K1 + 1) / (tf + norm);
+  }
+
+  // `weight` is jieba's tf * idf for a term occurring `tf` times.
+  uint8_t Impact(double weight, uint32_t tf, double length) const {
+    tf = std::max<uint32_t>(1, tf);
+    long q = std::lround(Score(tf, weight / tf, length) / BM25_QUANTUM);
+    return std::clamp<long>(q, 1, 255);
+  }
+};
+
+// Postings of all terms live back to back in one byte array, cut into
+// blocks of POSTING_BLOCK. A block is a bit width, the gap from the
+// previous block's last doc to its first as a varint, the rest of the doc
+// ID gaps bit-packed at that width, one quantized weight byte per posting,
+// then one BM25 impact byte per posting. The first gap is kept out of the
+// width since, with similar docs numbered together, it is where a term's
+// docs jump from one cluster to the next.
+//
+// maxScore on blocks and terms bounds weight / doc norm over the postings
+// they cover, rounded up so that pruning on it never drops a real hit;
+// maxImpact is the largest impact they cover.
+//
+// Positions are a separate stream that only phrase queries touch: for each
+// block, at positionBlocks[block], each posting's count and position gaps
+// as varints.
+//
+// Blocks and terms are written to snapshots byte for byte, so they are laid
+// out without padding, which would carry uninitialized bytes into the file.
+struct PostingStore {
+  struct Block {
+    uint64_t offset;
+    ArticleID last;
+    float maxScore;
+    uint32_t maxImpact;
+    uint32_t unused = 0;
+  };
+  static_assert(sizeof(Block) == sizeof(uint64_t) + 4 * sizeof(uint32_t));
+  struct Term {
+    uint32_t firstBlock;
+    uint32_t count;
+    float maxWeight;
+    float maxScore;
+    uint32_t maxImpact;
+  };
+  static_assert(sizeof(Term) == 5 * sizeof(uint32_t));
+
+  Array<uint8_t> data;
+  Array<Block> blocks;
+  Array<Term> terms;
+  Array<uint8_t> positions;
+  Array<uint64_t> positionBlocks;
+
+  static uint8_t Quantize(double w, float maxWeight) {
+    return maxWeight > 0 ? std::max(1l, std::lround(w / maxWeight * 255)) : 1;
+  }
+
+  // Decodes block `block` of term `t` into `docs`/`weights`/`impacts`;
+  // returns the number of postings in it.
+  int DecodeBlock(uint32_t t, uint32_t block, ArticleID* docs,
+                  uint8_t* weights, uint8_t* impacts) const {
+    auto const& term = terms[t];
+    uint32_t index = block - term.firstBlock;
+    int n = std::min<uint32_t>(POSTING_BLOCK,
+                               term.count - index * POSTING_BLOCK);
+    ArticleID doc = index ? blocks[block - 1].last : 0;
+    uint8_t const* p = data.data() + blocks[block].offset;
+    int width = *p++;
+    docs[0] = doc += GetVarint(p);
+    uint64_t mask = (1ull << width) - 1;
+    for (int i = 1, bits = 0; i < n; ++i, bits += width) {
+      uint64_t word;
+      memcpy(&word, p + bits / 8, 8);
+      docs[i] = doc += word >> (bits % 8) & mask;
+    }
+    p += ((n - 1) * width + 7) / 8;
+    memcpy(weights, p, n);
+    memcpy(impacts, p + n, n);
+    return n;
+  }
+
+  size_t Postings() const {
+    size_t n = 0;
+    for (auto const& t : terms) n += t.count;
+    return n;
+  }
+
+  size_t MemoryUsage() const {
+    return sizeof(*this) + data.Bytes() + blocks.Bytes() + terms.Bytes() +
+           positions.Bytes() + positionBlocks.Bytes();
+  }
+};
+
+// Encodes posting lists, term by term in term ID order, into a PostingStore.
+struct PostingWriter {
+  using Block = PostingStore::Block;
+  using Term = PostingStore::Term;
+
+  std::vector<uint8_t> data;
+  std::vector<Block> blocks;
+  std::vector<Term> terms;
+  std::vector<uint8_t> positions;
+  std::vector<uint64_t> positionBlocks;
+
+  // `list` must be sorted by doc ID, and `impacts` holds the impact of
+  // each posting; `pos`, if given, holds the positions of each posting.
+  void Append(PostingList const& list, NormFn const& norm,
+              std::vector<uint8_t> const& impacts,
+              std::vector<Positions> const& pos = {}) {
+    float maxWeight = 0;
+    for (auto const& [_, w] : list) maxWeight = std::max<float>(maxWeight, w);
+    std::vector<uint8_t> weights;
+    weights.reserve(list.size());
+    for (auto const& [_, w] : list)
+      weights.push_back(PostingStore::Quantize(w, maxWeight));
+    AppendQuantized(list, weights, maxWeight, norm, impacts, pos);
+  }
+
+  // Like Append, with each posting's weight already quantized against
+  // `maxWeight` in `weights`; the weights in `list` are not read. Lets a
+  // merge copy weights without rounding them again.
+  void AppendQuantized(PostingList const& list,
+                       std::vector<uint8_t> const& weights, float maxWeight,
+                       NormFn const& norm, std::vector<uint8_t> const& impacts,
+                       std::vector<Positions> const& pos = {}) {
+    Term term{(uint32_t)blocks.size(), (uint32_t)list.size(), maxWeight, 0,
+              0};
+    float scale = term.maxWeight / 255;
+    ArticleID base = 0;
+    for (size_t begin = 0; begin < list.size(); begin += POSTING_BLOCK) {
+      size_t n = std::min<size_t>(POSTING_BLOCK, list.size() - begin);
+      auto gap = [&](size_t i) {
+        return list[begin + i].first - (i ? list[begin + i - 1].first : base);
+      };
+      uint32_t maxGap = 0;
+      for (size_t i = 1; i < n; ++i) maxGap |= gap(i);
+      int width = 0;
+      while (width < 32 && maxGap >> width) ++width;
+
+      auto quantized = weights.begin() + begin;
+      double maxScore = 0;
+      for (size_t i = 0; i < n; ++i)
+        maxScore = std::max(
+            maxScore, quantized[i] * scale / norm(list[begin + i].first));
+      float bound = std::nextafter((float)maxScore, INFINITY);
+      term.maxScore = std::max(term.maxScore, bound);
+      auto impact = impacts.begin() + begin;
+      uint32_t maxImpact = *std::max_element(impact, impact + n);
+      term.maxImpact = std::max(term.maxImpact, maxImpact);
+      ArticleID last = list[begin + n - 1].first;
+      blocks.push_back({data.size(), last, bound, maxImpact});
+
+      data.push_back(width);
+      PutVarint(data, gap(0));
+      size_t bits = data.size() * 8;
+      data.resize(data.size() + ((n - 1) * width + 7) / 8);
+      for (size_t i = 1; i < n; ++i, bits += width)
+        for (int b = 0; b < width; ++b)
+          if (gap(i) >> b & 1) data[(bits + b) / 8] |= 1 << ((bits + b) % 8);
+      data.insert(data.end(), quantized, quantized + n);
+      data.insert(data.end(), impact, impact + n);
+      base = last;
+
+      positionBlocks.push_back(positions.size());
+      for (size_t i = 0; i < n; ++i) {
+        if (pos.empty()) {
+          PutVarint(positions, 0);
+          continue;
+        }
+        auto const& p = pos[begin + i];
+        PutVarint(positions, p.size());
+        for (size_t j = 0; j < p.size(); ++j)
+          PutVarint(positions, p[j] - (j ? p[j - 1] : 0));
+      }
+    }
+    terms.push_back(term);
+  }
+
+  // Called once every term is appended; leaves room for the decoder's
+  // 8-byte loads past the end of the last block.
+  PostingStore Finish() {
+    data.resize(data.size() + 8);
+    PostingStore store;
+    store.data = std::move(data);
+    store.blocks = std::move(blocks);
+    store.terms = std::move(terms);
+    store.positions = std::move(positions);
+    store.positionBlocks = std::move(positionBlocks);
+    return store;
+  }
+};
+
+// Walks one term's postings in doc ID order, a decoded block at a time.
+// `shallow` follows the block holding a probed doc ID without decoding it,
+// for block-max checks.
+struct PostingCursor {
+  PostingStore const* store;
+  uint32_t term, block, endBlock, shallow;
+  int pos, n;
+  float scale;
+  uint32_t decoded = 0;  // postings decoded so far
+  ArticleID docs[POSTING_BLOCK];
+  uint8_t weights[POSTING_BLOCK];
+  uint8_t impacts[POSTING_BLOCK];
+  // Position stream read point: just past the counts and gaps of the
+  // first positionDoc postings of positionBlock.
+  uint32_t positionBlock;
+  int positionDoc;
+  uint8_t const* positionPtr;
+
+  PostingCursor(PostingStore const& s, uint32_t t)
+      : store(&s),
+        term(t),
+        block(s.terms[t].firstBlock),
+        shallow(block),
+        pos(0),
+        n(0),
+        positionBlock(UINT32_MAX) {
+    auto const& info = s.terms[t];
+    endBlock = block + (info.count + POSTING_BLOCK - 1) / POSTING_BLOCK;
+    scale = info.maxWeight / 255;
+    Load();
+  }
+
+  ArticleID Doc() const { return pos < n ? docs[pos] : END_OF_LIST; }
+  double Weight() const { return weights[pos] * scale; }
+  uint8_t QuantizedWeight() const { return weights[pos]; }
+  float MaxWeight() const { return store->terms[term].maxWeight; }
+  uint32_t Impact() const { return impacts[pos]; }
+  uint32_t Count() const { return store->terms[term].count; }
+  float MaxScore() const { return store->terms[term].maxScore; }
+  uint32_t MaxImpact() const { return store->terms[term].maxImpact; }
+
+  // Moves `shallow` to the block that would hold `target`; returns false
+  // past the end of the list.
+  bool ShallowSeek(ArticleID target) {
+    shallow = std::max(shallow, block);
+    while (shallow < endBlock && store->blocks[shallow].last < target)
+      ++shallow;
+    return shallow < endBlock;
+  }
+  float BlockMaxScore() const { return store->blocks[shallow].maxScore; }
+  uint32_t BlockMaxImpact() const { return store->blocks[shallow].maxImpact; }
+  ArticleID BlockLast() const { return store->blocks[shallow].last; }
+
+  void Next() {
+    if (++pos == n) {
+      ++block;
+      Load();
+    }
+  }
+
+  // Advances to the first posting with doc >= target. The blocks' last doc
+  // IDs serve as skip pointers: whole blocks are skipped by galloping over
+  // them without decoding, so a far target costs a logarithmic number of
+  // probes, and the landing block is binary searched.
+  void NextGEQ(ArticleID target) {
+    if (Doc() >= target) return;
+    auto const& blocks = store->blocks;
+    if (blocks[block].last < target) {
+      uint32_t lo = block, step = 1;
+      while (lo + step < endBlock && blocks[lo + step].last < target) {
+        lo += step;
+        step *= 2;
+      }
+      uint32_t hi = std::min(lo + step, endBlock);
+      while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        (blocks[mid].last < target ? lo : hi) = mid;
+      }
+      block = hi;
+      Load();
+    }
+    pos = std::lower_bound(docs + pos, docs + n, target) - docs;
+  }
+
+  // Positions of the current posting, read forward through the block.
+  void ReadPositions(Positions& out) {
+    if (positionBlock != block || positionDoc > pos) {
+      positionBlock = block;
+      positionDoc = 0;
+      positionPtr = store->positions.data() + store->positionBlocks[block];
+    }
+    for (; positionDoc < pos; ++positionDoc)
+      for (auto count = GetVarint(positionPtr); count; --count)
+        GetVarint(positionPtr);
+    out.resize(GetVarint(positionPtr));
+    for (size_t i = 0; i < out.size(); ++i)
+      out[i] = (i ? out[i - 1] : 0) + GetVarint(positionPtr);
+    ++positionDoc;
+  }
+
+ private:
+  void Load() {
+    pos = 0;
+    n = block < endBlock
+            ? store->DecodeBlock(term, block, docs, weights, impacts)
+            : 0;
+    decoded += n;
+  }
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "postings.hpp"
+
+// A query as typed: free text plus quoted phrases. "小红鱼和小女孩" asks
+// for the phrase's words exactly as they appear in it; "天蝎 爱情"~10 asks
+// for them in any order, spread over at most 10 characters more than the
+// phrase itself. Phrase words also count as free text for scoring.
+//
+// Outside quotes, +word requires the word and -word excludes docs holding
+// it; a AND b requires both. Required words also count as free text,
+// excluded ones do not.
+struct Query {
+  struct Quoted {
+    std::string text;
+    int slop;  // -1 for an exact phrase
+  };
+  std::string text;
+  std::vector<Quoted> phrases;
+  std::vector<std::string> required, excluded;
+};
+
+inline uint32_t CharCount(std::string_view s) {
+  uint32_t n = 0;
+  for (char c : s) n += (c & 0xC0) != 0x80;
+  return n;
+}
+
+// Splits unquoted text into free text and operators.
+inline void ParseOperators(std::string_view s, Query& q) {
+  std::string_view last;  // the previous word, if free and not required
+  bool andNext = false;
+  for (size_t i = 0; i < s.size();) {
+    size_t end = i;
+    while (end < s.size() && !isspace((unsigned char)s[end])) ++end;
+    if (end == i) {
+      q.text += s[i++];
+      continue;
+    }
+    auto word = s.substr(i, end - i);
+    i = end;
+    if (word == "AND") {
+      if (!last.empty()) q.required.emplace_back(last);
+      last = {};
+      andNext = true;
+      continue;
+    }
+    if (word.size() > 1 && (word[0] == '+' || word[0] == '-')) {
+      (word[0] == '+' ? q.required : q.excluded).emplace_back(word.substr(1));
+      if (word[0] == '+') q.text.append(word.substr(1));
+      last = {};
+    } else {
+      if (andNext) q.required.emplace_back(word);
+      q.text.append(word);
+      last = andNext ? std::string_view() : word;
+    }
+    andNext = false;
+  }
+}
+
+inline Query ParseQuery(std::string_view s) {
+  Query q;
+  for (size_t i = 0; i < s.size();) {
+    size_t open = s.find('"', i);
+    ParseOperators(s.substr(i, open - i), q);
+    if (open == std::string_view::npos) break;
+    size_t close = std::min(s.find('"', open + 1), s.size());
+    auto text = s.substr(open + 1, close - open - 1);
+    q.text.append(text);
+    q.text += ' ';
+    int slop = -1;
+    i = close + 1;
+    if (i < s.size() && s[i] == '~') {
+      slop = 0;
+      for (++i; i < s.size() && isdigit((unsigned char)s[i]); ++i)
+        slop = std::min(slop * 10 + (s[i] - '0'), 1 << 20);
+    }
+    if (!text.empty()) q.phrases.push_back({std::string(text), slop});
+  }
+  return q;
+}
+
+// A phrase as the index sees it: its indexed words, and where each one
+// occurs in it. Words that are not indexed (stop words, single
+// characters) only take up room.
+struct Phrase {
+  std::vector<std::string> words;
+  std::vector<std::pair<uint32_t, uint32_t>> slots;  // {word, offset}
+  std::vector<uint32_t> lengths;                     // of words, in chars
+  uint32_t length = 0;
+  int slop = -1;
+
+  Phrase() = default;
+
+  // `kws` are the phrase's keywords with character positions as offsets.
+  template <class Keywords>
+  Phrase(Keywords const& kws, std::string_view text, int slop)
+      : length(CharCount(text)), slop(slop) {
+    for (auto const& kw : kws) {
+      for (auto offset : kw.offsets) slots.push_back({words.size(), offset});
+      words.push_back(kw.word);
+      lengths.push_back(CharCount(kw.word));
+    }
+    std::sort(slots.begin(), slots.end(),
+              [](auto const& a, auto const& b) { return a.second < b.second; });
+  }
+
+  // `positions[w]` are the positions of words[w] in a doc.
+  bool Match(std::vector<Positions> const& positions) const {
+    if (slots.empty()) return true;
+    if (slop < 0) {
+      auto [first, offset] = slots.front();
+      for (auto p : positions[first]) {
+        if (p < offset) continue;
+        bool all = true;
+        for (auto [w, o] : slots) {
+          auto const& pos = positions[w];
+          all &= std::binary_search(pos.begin(), pos.end(), p - offset + o);
+          if (!all) break;
+        }
+        if (all) return true;
+      }
+      return false;
+    }
+    // Smallest window holding every word: advance whichever word starts
+    // it until some list runs out.
+    std::vector<size_t> at(words.size());
+    for (auto const& pos : positions)
+      if (pos.empty()) return false;
+    while (true) {
+      size_t first = 0;
+      uint32_t end = 0;
+      for (size_t w = 0; w < words.size(); ++w) {
+        if (positions[w][at[w]] < positions[first][at[first]]) first = w;
+        end = std::max(end, positions[w][at[w]] + lengths[w]);
+      }
+      if (end - positions[first][at[first]] <= length + slop) return true;
+      if (++at[first] == positions[first].size()) return false;
+    }
+  }
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../third_party/json.hpp"
+#include "metrics.hpp"
+
+const size_t QUERY_LOG_QUEUE = 4096;  // records waiting to be written
+const std::chrono::milliseconds QUERY_LOG_FLUSH_INTERVAL(100);
+
+// Appends a sample of the searches served to a JSONL file for loadgen to
+// replay, one per line:
+//   {"ts": microseconds since the epoch, "sentence": ..., "mode": ...,
+//    "scoring": ..., "snippet_length": ...}
+// with mode and scoring as the request gave them. A fraction `rate` of
+// searches is kept, spread evenly: search n is kept when n * rate passes
+// a whole number.
+//
+// Record only queues the search; a background thread formats and writes
+// the queue out every QUERY_LOG_FLUSH_INTERVAL, or sooner once it is half
+// full, and at shutdown. A full queue drops the record and counts it in
+// /metrics rather than hold up the search.
+struct QueryLog {
+  struct Entry {
+    int64_t ts;
+    std::string sentence, mode, scoring;
+    size_t snippetLength;
+  };
+
+  std::ofstream out;
+  double rate;
+  std::atomic<uint64_t> seen{0};
+  std::mutex mutex;  // guards queue and stopping
+  std::condition_variable wake;
+  std::vector<Entry> queue;
+  bool stopping = false;
+  std::thread writer;
+
+  QueryLog(std::string const& path, double rate)
+      : out(path, std::ios::app), rate(rate) {
+    if (!out) throw std::runtime_error("cannot open " + path);
+    queue.reserve(QUERY_LOG_QUEUE);
+    writer = std::thread([this] { Loop(); });
+  }
+  ~QueryLog() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+  }
+
+  void Record(std::string const& sentence, std::string const& mode,
+              std::string const& scoring, size_t snippetLength) {
+    uint64_t n = seen++;
+    if ((uint64_t)((n + 1) * rate) == (uint64_t)(n * rate)) return;
+    auto ts = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count();
+    Entry e{ts, sentence, mode, scoring, snippetLength};
+    bool wakeWriter;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (queue.size() == QUERY_LOG_QUEUE) {
+        metrics.queryLogDropped.Add(1);
+        return;
+      }
+      queue.push_back(std::move(e));
+      wakeWriter = queue.size() == QUERY_LOG_QUEUE / 2;
+    }
+    if (wakeWriter) wake.notify_one();
+  }
+
+ private:
+  void Loop() {
+    std::vector<Entry> batch;
+    batch.reserve(QUERY_LOG_QUEUE);
+    std::string text;
+    for (bool stop = false; !stop;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait_for(lock, QUERY_LOG_FLUSH_INTERVAL, [&] {
+          return stopping || queue.size() >= QUERY_LOG_QUEUE / 2;
+        });
+        stop = stopping;
+        batch.swap(queue);
+      }
+      if (batch.empty()) continue;
+      text.clear();
+      for (auto const& e : batch) {
+        nlohmann::json j = {{"ts", e.ts},
+                            {"sentence", e.sentence},
+                            {"mode", e.mode},
+                            {"scoring", e.scoring},
+                            {"snippet_length", e.snippetLength}};
+        text += j.dump(-1, ' ', false,
+                       nlohmann::json::error_handler_t::replace);
+        text += '\n';
+      }
+      out.write(text.data(), text.size());
+      out.flush();
+      batch.clear();
+    }
+  }
+};
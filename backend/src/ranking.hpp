@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+
+#include "postings.hpp"
+
+struct Hit {
+  ArticleID id;
+  double score;
+};
+
+// Higher score first; ties go to the lower doc ID so every ranking path
+// agrees on the same order.
+inline bool Better(Hit const& a, Hit const& b) {
+  return a.score > b.score || (a.score == b.score && a.id < b.id);
+}
+
+// Bounded min-heap keeping the k best hits with a positive score.
+struct TopK {
+  size_t k;
+  std::vector<Hit> heap;
+
+  explicit TopK(size_t k) : k(k) { heap.reserve(k); }
+
+  // A candidate must beat this to enter.
+  double Threshold() const { return heap.size() < k ? 0 : heap.front().score; }
+
+  void Push(Hit hit) {
+    if (hit.score <= 0) return;
+    if (heap.size() < k) {
+      heap.push_back(hit);
+      std::push_heap(heap.begin(), heap.end(), Better);
+    } else if (Better(hit, heap.front())) {
+      std::pop_heap(heap.begin(), heap.end(), Better);
+      heap.back() = hit;
+      std::push_heap(heap.begin(), heap.end(), Better);
+    }
+  }
+
+  std::vector<Hit> Sorted() {
+    std::sort_heap(heap.begin(), heap.end(), Better);
+    return std::move(heap);
+  }
+};
+
+// `count` is how often the term occurs in the query, which BM25 scales its
+// impacts by.
+struct QueryTerm {
+  PostingCursor cursor;
+  double weight;
+  uint32_t count = 1;
+};
+
+// How Wand scores: the bounds are in final score units, while postings
+// add up in Acc, which Final turns into the score.
+//
+// Cosine: sum of posting weight * query weight, divided by the doc norm.
+struct CosineScoring {
+  using Acc = double;
+  NormFn norm;
+
+  static double Bound(QueryTerm const& t) {
+    return t.cursor.MaxScore() * t.weight;
+  }
+  static double BlockBound(QueryTerm const& t) {
+    return t.cursor.BlockMaxScore() * t.weight;
+  }
+  static double Add(QueryTerm const& t) { return t.cursor.Weight() * t.weight; }
+  double Final(ArticleID doc, double acc) const { return acc / norm(doc); }
+};
+
+// BM25: sum of the postings' impacts, each as many times as its term
+// occurs in the query; integers all the way.
+struct Bm25Scoring {
+  using Acc = uint32_t;
+
+  static double Bound(QueryTerm const& t) {
+    return t.cursor.MaxImpact() * t.count * BM25_QUANTUM;
+  }
+  static double BlockBound(QueryTerm const& t) {
+    return t.cursor.BlockMaxImpact() * t.count * BM25_QUANTUM;
+  }
+  static uint32_t Add(QueryTerm const& t) {
+    return t.cursor.Impact() * t.count;
+  }
+  double Final(ArticleID, uint32_t acc) const { return acc * BM25_QUANTUM; }
+};
+
+// What one ranking pass touched, for the metrics.
+struct Scanned {
+  size_t postings = 0, candidates = 0;
+};
+
+// Document-at-a-time Block-Max WAND.
+// Leaves in `top` exactly what an exhaustive pass would, without decoding
+// blocks whose max scores cannot reach the current threshold. Only docs in
+// [begin, end) are scored.
+template <class Scoring>
+Scanned Wand(std::vector<QueryTerm> terms, TopK& top, Scoring const& scoring,
+             std::function<bool(ArticleID)> const& deleted,
+             ArticleID begin = 0, ArticleID end = END_OF_LIST) {
+  Scanned scanned;
+  std::vector<QueryTerm*> order;
+  for (auto& t : terms) {
+    t.cursor.NextGEQ(begin);
+    order.push_back(&t);
+  }
+  auto byDoc = [](QueryTerm* a, QueryTerm* b) {
+    return a->cursor.Doc() < b->cursor.Doc();
+  };
+  auto docAt = [&](size_t i) {
+    return i < order.size() ? order[i]->cursor.Doc() : END_OF_LIST;
+  };
+
+  while (true) {
+    std::sort(order.begin(), order.end(), byDoc);
+    double threshold = top.Threshold(), upper = 0;
+    size_t pivot = 0;
+    for (; pivot < order.size(); ++pivot) {
+      if (order[pivot]->cursor.Doc() == END_OF_LIST) break;
+      upper += Scoring::Bound(*order[pivot]);
+      if (upper > threshold) break;
+    }
+    ArticleID doc = docAt(pivot);
+    if (doc >= end) break;
+    while (docAt(pivot + 1) == doc) ++pivot;
+
+    double blockUpper = 0;
+    ArticleID next = docAt(pivot + 1);
+    for (size_t i = 0; i <= pivot; ++i) {
+      auto& c = order[i]->cursor;
+      if (!c.ShallowSeek(doc)) continue;
+      blockUpper += Scoring::BlockBound(*order[i]);
+      next = std::min<ArticleID>(next, c.BlockLast() + 1);
+    }
+    if (blockUpper <= threshold) {
+      for (size_t i = 0; i <= pivot; ++i) order[i]->cursor.NextGEQ(next);
+      continue;
+    }
+
+    if (order[0]->cursor.Doc() != doc) {
+      for (size_t i = 0; i < pivot; ++i) order[i]->cursor.NextGEQ(doc);
+      continue;
+    }
+
+    typename Scoring::Acc acc = 0;
+    for (auto& t : terms)
+      if (t.cursor.Doc() == doc) {
+        acc += Scoring::Add(t);
+        t.cursor.Next();
+      }
+    ++scanned.candidates;
+    if (!deleted(doc)) top.Push({doc, scoring.Final(doc, acc)});
+  }
+  for (auto const& t : terms) scanned.postings += t.cursor.decoded;
+  return scanned;
+}
+
+// Calls f(doc) for every doc in all of `cursors`. The shortest list leads
+// and the others gallop to its docs, so the cost follows the rarest term
+// rather than the most common one.
+template <class F>
+void Intersect(std::vector<PostingCursor*> cursors, F const& f) {
+  if (cursors.empty()) return;
+  std::sort(cursors.begin(), cursors.end(),
+            [](auto a, auto b) { return a->Count() < b->Count(); });
+  for (ArticleID doc = 0; doc != END_OF_LIST;) {
+    bool all = true;
+    for (auto c : cursors) {
+      c->NextGEQ(doc);
+      if (c->Doc() != doc) {
+        all = false;
+        doc = c->Doc();
+        break;
+      }
+    }
+    if (!all) continue;
+    f(doc);
+    ++doc;
+  }
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include "docs.hpp"
+#include "index.hpp"
+
+// Ranges of at most this many docs keep their order.
+const size_t REORDER_MIN_DOCS = 16;
+const int REORDER_ITERATIONS = 20;
+
+// The term IDs of each of the first `docs` docs of `postings`, ascending.
+inline std::vector<std::vector<uint32_t>> ForwardIndex(
+    PostingStore const& postings, size_t docs) {
+  std::vector<std::vector<uint32_t>> fwd(docs);
+  for (uint32_t t = 0; t < postings.terms.size(); ++t)
+    for (PostingCursor c(postings, t); c.Doc() != END_OF_LIST; c.Next())
+      fwd[c.Doc()].push_back(t);
+  return fwd;
+}
+
+// Average bits per posting spent on doc IDs: the width byte, the first
+// gap and the packed gaps of each block.
+inline double DocIdBits(PostingStore const& postings) {
+  uint64_t bits = 0, n = 0;
+  for (auto const& term : postings.terms)
+    for (uint32_t i = 0; i * POSTING_BLOCK < term.count; ++i) {
+      auto count = std::min<uint32_t>(POSTING_BLOCK,
+                                      term.count - i * POSTING_BLOCK);
+      auto p =
+          postings.data.data() + postings.blocks[term.firstBlock + i].offset;
+      auto width = *p++;
+      auto first = p;
+      GetVarint(p);
+      bits += 8 * (1 + (p - first)) + (uint64_t)width * (count - 1);
+      n += count;
+    }
+  return n ? (double)bits / n : 0;
+}
+
+// Recursive graph bisection (Dhulipala et al., KDD 2016): splits the docs
+// in two, swaps docs between the halves while that lowers the estimated
+// cost of the gaps, d * log2(n / (d + 1)) for a term in d of a half's n
+// docs, then does the same within each half. Docs sharing terms end up
+// close together, so gaps shrink. `order` is the result, new ID -> old.
+struct Bisection {
+  std::vector<std::vector<uint32_t>> const& fwd;
+  std::vector<ArticleID> order;
+  std::vector<int32_t> left, right;  // degrees of each term in the halves
+  std::vector<double> toLeft, toRight;  // cost saved moving a doc of a term
+  std::vector<double> gain;  // of moving each doc to the other half
+  std::vector<uint32_t> touched;  // terms of the range being split
+
+  Bisection(std::vector<std::vector<uint32_t>> const& fwd, size_t terms)
+      : fwd(fwd), order(fwd.size()), left(terms), right(terms),
+        toLeft(terms), toRight(terms), gain(fwd.size()) {
+    std::iota(order.begin(), order.end(), 0);
+    Split(0, order.size());
+  }
+
+ private:
+  static double Cost(double d, double n) { return d * std::log2(n / (d + 1)); }
+
+  void Split(size_t lo, size_t hi) {
+    if (hi - lo <= REORDER_MIN_DOCS) return;
+    size_t mid = lo + (hi - lo) / 2;
+    double nl = mid - lo, nr = hi - mid;
+    for (int it = 0; it < REORDER_ITERATIONS; ++it) {
+      touched.clear();
+      for (size_t i = lo; i < hi; ++i)
+        for (auto t : fwd[order[i]]) {
+          if (!left[t] && !right[t]) touched.push_back(t);
+          ++(i < mid ? left : right)[t];
+        }
+      for (auto t : touched) {
+        double l = left[t], r = right[t];
+        double now = Cost(l, nl) + Cost(r, nr);
+        toRight[t] = l ? now - Cost(l - 1, nl) - Cost(r + 1, nr) : 0;
+        toLeft[t] = r ? now - Cost(l + 1, nl) - Cost(r - 1, nr) : 0;
+      }
+      for (size_t i = lo; i < hi; ++i) {
+        double g = 0;
+        for (auto t : fwd[order[i]]) g += (i < mid ? toRight : toLeft)[t];
+        gain[order[i]] = g;
+      }
+      for (auto t : touched) left[t] = right[t] = 0;
+      auto byGain = [&](ArticleID a, ArticleID b) { return gain[a] > gain[b]; };
+      std::sort(order.begin() + lo, order.begin() + mid, byGain);
+      std::sort(order.begin() + mid, order.begin() + hi, byGain);
+      size_t swapped = 0;
+      for (; lo + swapped < mid && mid + swapped < hi; ++swapped) {
+        auto& a = order[lo + swapped];
+        auto& b = order[mid + swapped];
+        if (gain[a] + gain[b] <= 0) break;
+        std::swap(a, b);
+      }
+      if (!swapped) break;
+    }
+    Split(lo, mid);
+    Split(mid, hi);
+  }
+};
+
+// Renumbers the docs of `index` and `docs`, all frozen, so doc order[i]
+// becomes doc i. Row IDs move with their docs, so each doc still maps back
+// to its SQLite row; docs added later must look up the last row by the
+// largest row ID rather than the last doc. Contents are copied once,
+// straight into the new flat text, and postings keep their quantized
+// weights as stored, so the reorder cannot move any score.
+inline void Relabel(InvertedIndex& index, DocTable& docs,
+                    std::vector<ArticleID> const& order) {
+  std::vector<ArticleID> newId(order.size());
+  for (size_t i = 0; i < order.size(); ++i) newId[order[i]] = i;
+
+  std::vector<double> norms;
+  std::vector<int64_t> rowids;
+  std::vector<uint64_t> offsets{0};
+  std::vector<char> text;
+  norms.reserve(order.size());
+  rowids.reserve(order.size());
+  offsets.reserve(order.size() + 1);
+  text.reserve(docs.text.size());
+  for (auto old : order) {
+    auto content = docs.Content(old);
+    text.insert(text.end(), content.begin(), content.end());
+    offsets.push_back(text.size());
+    norms.push_back(docs.Norm(old));
+    rowids.push_back(docs.RowID(old));
+  }
+  DocTable relabeled;
+  relabeled.norms = std::move(norms);
+  relabeled.rowids = std::move(rowids);
+  relabeled.offsets = std::move(offsets);
+  relabeled.text = std::move(text);
+  for (size_t i = 0; i < order.size(); ++i)
+    if (docs.Deleted(order[i])) relabeled.Delete(i);
+
+  struct Entry {
+    Posting posting;
+    uint8_t weight;
+    uint8_t impact;
+    Positions positions;
+  };
+  PostingWriter writer;
+  std::vector<Entry> entries;
+  PostingList list;
+  std::vector<uint8_t> weights, impacts;
+  std::vector<Positions> positions;
+  for (uint32_t t = 0; t < index.postings.terms.size(); ++t) {
+    entries.clear();
+    PostingCursor c(index.postings, t);
+    float maxWeight = c.MaxWeight();
+    for (; c.Doc() != END_OF_LIST; c.Next()) {
+      auto& e = entries.emplace_back();
+      e.posting = {newId[c.Doc()], c.Weight()};
+      e.weight = c.QuantizedWeight();
+      e.impact = c.Impact();
+      c.ReadPositions(e.positions);
+    }
+    std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) {
+      return a.posting.first < b.posting.first;
+    });
+    list.clear();
+    weights.clear();
+    impacts.clear();
+    positions.clear();
+    for (auto& e : entries) {
+      list.push_back(e.posting);
+      weights.push_back(e.weight);
+      impacts.push_back(e.impact);
+      positions.push_back(std::move(e.positions));
+    }
+    writer.AppendQuantized(list, weights, maxWeight,
+                           [&](ArticleID i) { return relabeled.Norm(i); },
+                           impacts, positions);
+  }
+  index.postings = writer.Finish();
+  index.impacts = BuildImpactOrder(index.postings);
+  docs = std::move(relabeled);
+}
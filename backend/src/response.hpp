@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Response bodies without a JSON DOM. A JsonWriter renders the structure
+// and the short values into `frame` as they are added; long strings that
+// outlive it, doc contents above all, are kept as views of where they
+// are and escaped only as the body goes out. Size() is known beforehand,
+// so httplib can send the body with a Content-Length through a content
+// provider, whose writes go to the socket as they are.
+const size_t JSON_WRITE_BUFFER = 16384;
+// Runs that need no escaping at least this long are written from where
+// they are instead of through the buffer.
+const size_t JSON_DIRECT_RUN = 4096;
+
+struct JsonWriter {
+  std::string frame;
+  // Strings to escape into the body at frame offsets, in order.
+  std::vector<std::pair<size_t, std::string_view>> views;
+  bool comma = false;
+
+  JsonWriter& Open(char bracket) {
+    Separate();
+    frame += bracket;
+    comma = false;
+    return *this;
+  }
+  JsonWriter& Close(char bracket) {
+    frame += bracket;
+    comma = true;
+    return *this;
+  }
+  JsonWriter& Key(std::string_view key) {
+    String(key);
+    frame += ':';
+    comma = false;
+    return *this;
+  }
+  JsonWriter& String(std::string_view s) {
+    Separate();
+    frame += '"';
+    Escape(s, [&](char const* p, size_t n) { frame.append(p, n); });
+    frame += '"';
+    comma = true;
+    return *this;
+  }
+  // A string that stays put until the body has been written.
+  JsonWriter& View(std::string_view s) {
+    Separate();
+    frame += '"';
+    views.push_back({frame.size(), s});
+    frame += '"';
+    comma = true;
+    return *this;
+  }
+  template <class T>
+  JsonWriter& Number(T v) {
+    Separate();
+    comma = true;
+    if constexpr (std::is_floating_point_v<T>) {
+      if (!std::isfinite(v)) {
+        frame += "null";
+        return *this;
+      }
+    }
+    char s[32];
+    frame.append(s, std::to_chars(s, s + sizeof s, v).ptr);
+    return *this;
+  }
+  JsonWriter& Null() {
+    Separate();
+    frame += "null";
+    comma = true;
+    return *this;
+  }
+  JsonWriter& Bool(bool v) {
+    Separate();
+    frame += v ? "true" : "false";
+    comma = true;
+    return *this;
+  }
+
+  // Calls emit(p, n) with the pieces of s escaped, unescaped runs as they
+  // are in s.
+  template <class F>
+  static void Escape(std::string_view s, F&& emit) {
+    for (size_t i = 0; i < s.size();) {
+      size_t run = Plain(s.data() + i, s.size() - i);
+      emit(s.data() + i, run);
+      if ((i += run) == s.size()) break;
+      char e[8];
+      emit(e, EscapeChar(s[i++], e));
+    }
+  }
+  static size_t EscapedSize(std::string_view s) {
+    size_t size = s.size();
+    for (size_t i = 0; i < s.size();) {
+      if ((i += Plain(s.data() + i, s.size() - i)) == s.size()) break;
+      char e[8];
+      size += EscapeChar(s[i++], e) - 1;
+    }
+    return size;
+  }
+
+  size_t Size() const {
+    size_t size = frame.size();
+    for (auto const& [_, s] : views) size += EscapedSize(s);
+    return size;
+  }
+
+  // Writes bytes [offset, offset + length) of the body through
+  // write(p, n), which returns false to stop.
+  template <class W>
+  bool Write(size_t offset, size_t length, W&& write) const {
+    std::string buffer;
+    buffer.reserve(JSON_WRITE_BUFFER);
+    size_t at = 0, end = offset + length;
+    bool ok = true;
+    auto flush = [&] {
+      ok = ok && (buffer.empty() || write(buffer.data(), buffer.size()));
+      buffer.clear();
+    };
+    auto emit = [&](char const* p, size_t n) {
+      size_t from = std::max(at, offset), to = std::min(at + n, end);
+      at += n;
+      if (!ok || from >= to) return;
+      p += from - (at - n);
+      n = to - from;
+      if (n >= JSON_DIRECT_RUN) {
+        flush();
+        ok = ok && write(p, n);
+        return;
+      }
+      if (buffer.size() + n > JSON_WRITE_BUFFER) flush();
+      buffer.append(p, n);
+    };
+    size_t cut = 0;
+    for (auto const& [pos, s] : views) {
+      if (at >= end) break;
+      emit(frame.data() + cut, pos - cut);
+      cut = pos;
+      Escape(s, emit);
+    }
+    emit(frame.data() + cut, frame.size() - cut);
+    flush();
+    return ok;
+  }
+
+ private:
+  void Separate() {
+    if (comma) frame += ',';
+  }
+
+  // The length of the run at p that needs no escaping, looked for eight
+  // bytes at a time: a word is clear when none of its bytes is below 0x20,
+  // '"' or '\\'.
+  static size_t Plain(char const* p, size_t n) {
+    const uint64_t ones = 0x0101010101010101, highs = ones << 7;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      uint64_t v;
+      memcpy(&v, p + i, 8);
+      uint64_t q = v ^ (ones * '"'), b = v ^ (ones * '\\');
+      uint64_t hits = ((v - ones * 0x20) & ~v) | ((q - ones) & ~q) |
+                      ((b - ones) & ~b);
+      if (hits & highs) break;
+    }
+    char e[8];
+    while (i < n && !EscapeChar(p[i], e)) ++i;
+    return i;
+  }
+
+  // The escape for c in e and its size, or 0 if c needs none.
+  static size_t EscapeChar(char c, char* e) {
+    if ((unsigned char)c >= 0x20 && c != '"' && c != '\\') return 0;
+    // Each character with the letter that escapes it.
+    char const* escapes = "\"\"\\\\\bb\ff\nn\rr\tt";
+    e[0] = '\\';
+    for (char const* x = escapes; *x; x += 2)
+      if (*x == c) {
+        e[1] = x[1];
+        return 2;
+      }
+    static char const hex[] = "0123456789abcdef";
+    memcpy(e + 1, "u00", 3);
+    e[4] = hex[c >> 4];
+    e[5] = hex[c & 15];
+    return 6;
+  }
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <memory>
+
+#include "index.hpp"
+
+const size_t SEAL_DOCS = 256;
+const size_t MERGE_FACTOR = 4;
+const double COMPACT_RATIO = 0.2;
+
+struct MemTerm {
+  std::string word;
+  double weight;
+  Positions positions;
+
+  bool operator<(MemTerm const& o) const { return word < o.word; }
+};
+
+// A document added since the last seal, kept as its own sorted keyword
+// list and scored by a direct scan.
+struct MemDoc {
+  ArticleID id;
+  double w;
+  std::vector<MemTerm> terms;  // sorted by word
+  uint32_t length = 0;         // DocLength(terms), set when indexed
+
+  MemTerm const* Find(std::string_view word) const {
+    auto it = std::lower_bound(
+        terms.begin(), terms.end(), word,
+        [](auto const& t, std::string_view w) { return t.word < w; });
+    return it != terms.end() && it->word == word ? &*it : nullptr;
+  }
+  double Weight(std::string_view word) const {
+    auto t = Find(word);
+    return t ? t->weight : 0;
+  }
+  uint32_t Impact(std::string_view word, Bm25 const& bm25) const {
+    auto t = Find(word);
+    return t ? bm25.Impact(t->weight, t->positions.size(), length) : 0;
+  }
+};
+using MemDocPtr = std::shared_ptr<MemDoc const>;
+
+// An immutable index over the contiguous doc ID range [first, end), with
+// the norms of those docs. `purged` counts the deleted docs whose postings
+// were already dropped when it was built.
+struct Segment {
+  ArticleID first, end;
+  InvertedIndex index;
+  Array<double> norms;
+  size_t purged = 0;
+
+  size_t Docs() const { return end - first; }
+  double Norm(ArticleID i) const { return norms[i - first]; }
+};
+using SegmentPtr = std::shared_ptr<Segment const>;
+
+inline SegmentPtr SealSegment(std::vector<MemDocPtr> const& docs,
+                              Bm25 const& bm25) {
+  auto seg = std::make_shared<Segment>();
+  seg->first = docs.front()->id;
+  seg->end = docs.back()->id + 1;
+  std::vector<double> norms(seg->Docs());
+  IndexBuilder builder;
+  for (auto const& doc : docs) {
+    norms[doc->id - seg->first] = doc->w;
+    for (auto const& t : doc->terms)
+      builder.Insert(t.word, {doc->id, t.weight}, t.positions);
+  }
+  seg->norms = std::move(norms);
+  seg->index =
+      builder.Build([&](ArticleID i) { return seg->Norm(i); }, bm25);
+  return seg;
+}
+
+// Merges segments covering adjacent doc ranges, in doc order, by walking
+// their sorted dictionaries side by side and concatenating each term's
+// postings and positions. Postings of docs set in `dead` (indexed from
+// the first doc of the run) are dropped; a run of one segment just
+// compacts it.
+//
+// A merged term keeps the largest maxWeight of its inputs, so weights
+// from the segments quantized on that scale, and every weight of a
+// compacted segment, are copied as stored; only the others are rounded
+// onto the new scale, once.
+inline SegmentPtr MergeSegments(std::vector<SegmentPtr> const& run,
+                                std::vector<bool> const& dead) {
+  auto seg = std::make_shared<Segment>();
+  seg->first = run.front()->first;
+  seg->end = run.back()->end;
+  seg->purged = std::count(dead.begin(), dead.end(), true);
+  std::vector<double> norms;
+  for (auto const& s : run)
+    norms.insert(norms.end(), s->norms.begin(), s->norms.end());
+  seg->norms = std::move(norms);
+
+  std::vector<std::vector<std::string>> terms(run.size());
+  for (size_t i = 0; i < run.size(); ++i)
+    run[i]->index.dict.ForEach(
+        [&](uint32_t, std::string_view t) { terms[i].emplace_back(t); });
+  std::vector<size_t> next(run.size());
+  std::vector<std::string> words;
+  PostingWriter writer;
+  PostingList list;
+  std::vector<uint8_t> weights, impacts;
+  std::vector<Positions> positions;
+  while (true) {
+    std::string const* word = nullptr;
+    for (size_t i = 0; i < run.size(); ++i)
+      if (next[i] < terms[i].size() && (!word || terms[i][next[i]] < *word))
+        word = &terms[i][next[i]];
+    if (!word) break;
+    words.push_back(*word);
+    list.clear();
+    weights.clear();
+    impacts.clear();
+    positions.clear();
+    auto has = [&](size_t i) {
+      return next[i] < terms[i].size() && terms[i][next[i]] == words.back();
+    };
+    float maxWeight = 0;
+    for (size_t i = 0; i < run.size(); ++i)
+      if (has(i))
+        maxWeight = std::max(
+            maxWeight, run[i]->index.postings.terms[next[i]].maxWeight);
+    for (size_t i = 0; i < run.size(); ++i) {
+      if (!has(i)) continue;
+      PostingCursor c(run[i]->index.postings, next[i]++);
+      bool same = c.MaxWeight() == maxWeight;
+      for (; c.Doc() != END_OF_LIST; c.Next()) {
+        if (dead[c.Doc() - seg->first]) continue;
+        list.push_back({c.Doc(), c.Weight()});
+        weights.push_back(same ? c.QuantizedWeight()
+                               : PostingStore::Quantize(c.Weight(), maxWeight));
+        impacts.push_back(c.Impact());
+        c.ReadPositions(positions.emplace_back());
+      }
+    }
+    if (list.empty()) {
+      words.pop_back();
+      continue;
+    }
+    writer.AppendQuantized(list, weights, maxWeight,
+                           [&](ArticleID i) { return seg->Norm(i); }, impacts,
+                           positions);
+  }
+  seg->index.dict.Build(words);
+  seg->index.bm25 = run.front()->index.bm25;
+  seg->index.postings = writer.Finish();
+  seg->index.impacts = BuildImpactOrder(seg->index.postings);
+  return seg;
+}
+
+// Size tier of a segment: how many MERGE_FACTOR-fold merges of sealed
+// segments it takes to reach its size.
+inline int Tier(Segment const& seg) {
+  int tier = 0;
+  for (size_t n = seg.Docs() / SEAL_DOCS; n >= MERGE_FACTOR; n /= MERGE_FACTOR)
+    ++tier;
+  return tier;
+}
+
+// Picks the next run of segments to rewrite: MERGE_FACTOR adjacent
+// segments of the same tier, newest first, or else a single segment in
+// which at least COMPACT_RATIO of the docs were deleted since it was
+// built. Returns {first index, count}, with count 0 if nothing is due.
+template <class DeadCount>
+std::pair<size_t, size_t> PickMerge(std::vector<SegmentPtr> const& segments,
+                                    DeadCount deadCount) {
+  for (size_t end = segments.size(); end >= MERGE_FACTOR; --end) {
+    size_t begin = end - MERGE_FACTOR;
+    int tier = Tier(*segments[begin]);
+    bool same = true;
+    for (size_t i = begin + 1; i < end; ++i)
+      same &= Tier(*segments[i]) == tier;
+    if (same) return {begin, MERGE_FACTOR};
+  }
+  for (size_t i = 0; i < segments.size(); ++i) {
+    auto const& seg = *segments[i];
+    size_t dead = deadCount(seg.first, seg.end) - seg.purged;
+    if (dead && dead >= COMPACT_RATIO * seg.Docs()) return {i, 1};
+  }
+  return {0, 0};
+}
+
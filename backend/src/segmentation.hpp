@@ -1,3 +1,7 @@
+#pragma once
+
+#include <algorithm>
+#include <string_view>
 #include <vector>
 
 #include "../third_party/cppjieba/Jieba.hpp"
@@ -13,9 +17,24 @@ struct Jieba {
   cppjieba::Jieba jieba;
   Jieba()
       : jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH, STOP_WORD_PATH) {}
-  KeywordList Keywords(std::string s) {
+  KeywordList Keywords(std::string s) const {
     KeywordList keywordres;
     jieba.extractor.Extract(s, keywordres, -1);
     return keywordres;
   }
-};
\ No newline at end of file
+};
+
+// Turns the byte offsets Extract reports for each keyword into character
+// positions, which is what the index stores.
+inline void ToCharPositions(std::string_view s, KeywordList& kws) {
+  std::vector<size_t*> offsets;
+  for (auto& kw : kws)
+    for (auto& offset : kw.offsets) offsets.push_back(&offset);
+  std::sort(offsets.begin(), offsets.end(),
+            [](size_t* a, size_t* b) { return *a < *b; });
+  size_t chars = 0, i = 0;
+  for (auto offset : offsets) {
+    for (; i < *offset; ++i) chars += (s[i] & 0xC0) != 0x80;
+    *offset = chars;
+  }
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+
+#include "docs.hpp"
+#include "index.hpp"
+
+// Binary index snapshot, mapped read-only by the server. Layout: a header,
+// a fixed table with one entry per section, then the sections themselves,
+// each aligned so its array can be used in place. Nothing written has
+// padding in it, so the same index always gives the same bytes.
+const char SNAPSHOT_MAGIC[8] = {'P', 'E', 'T', 'A', 'L', 'I', 'D', 'X'};
+const uint32_t SNAPSHOT_VERSION = 7;
+const size_t SNAPSHOT_ALIGN = 64;
+
+enum SnapshotSection : uint32_t {
+  SECTION_META,
+  SECTION_DICT_DATA,
+  SECTION_DICT_BLOCKS,
+  SECTION_POSTING_DATA,
+  SECTION_POSTING_BLOCKS,
+  SECTION_POSTING_TERMS,
+  SECTION_POSITION_DATA,
+  SECTION_POSITION_BLOCKS,
+  SECTION_IMPACT_DATA,
+  SECTION_IMPACT_RUNS,
+  SECTION_IMPACT_TERMS,
+  SECTION_DOC_NORMS,
+  SECTION_DOC_ROWIDS,
+  SECTION_DOC_OFFSETS,
+  SECTION_DOC_TEXT,
+  SECTION_COUNT
+};
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t sections;
+  uint64_t checksum;  // of the section table
+};
+static_assert(std::has_unique_object_representations_v<SnapshotHeader>);
+
+struct SnapshotEntry {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t checksum;
+};
+static_assert(std::has_unique_object_representations_v<SnapshotEntry>);
+
+struct SnapshotMeta {
+  uint64_t terms;
+  uint64_t docs;
+  uint64_t trieNodes;
+  double avgLength;  // for BM25
+};
+static_assert(sizeof(SnapshotMeta) == 4 * sizeof(uint64_t));
+
+// Writes the index and the frozen part of `docs` to `path`, through a
+// temporary file renamed into place so readers never see a partial file.
+inline void WriteSnapshot(std::string const& path, InvertedIndex const& index,
+                          DocTable const& docs) {
+  std::string tmp = path + ".tmp";
+  std::ofstream out(tmp, std::ios::binary);
+  SnapshotEntry table[SECTION_COUNT] = {};
+  size_t pos = sizeof(SnapshotHeader) + sizeof(table);
+  auto put = [&](SnapshotSection s, void const* data, size_t size) {
+    static char const zeros[SNAPSHOT_ALIGN] = {};
+    size_t pad = (SNAPSHOT_ALIGN - pos % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+    out.write(zeros, pad);
+    pos += pad;
+    table[s] = {pos, size, Checksum(data, size)};
+    out.write((char const*)data, size);
+    pos += size;
+  };
+  auto putArray = [&](SnapshotSection s, auto const& a) {
+    put(s, a.data(), a.Bytes());
+  };
+
+  out.seekp(pos);
+  SnapshotMeta meta{index.dict.size, docs.Frozen(), index.dict.trieNodes,
+                    index.bm25.avgLength};
+  put(SECTION_META, &meta, sizeof(meta));
+  putArray(SECTION_DICT_DATA, index.dict.data);
+  putArray(SECTION_DICT_BLOCKS, index.dict.blocks);
+  putArray(SECTION_POSTING_DATA, index.postings.data);
+  putArray(SECTION_POSTING_BLOCKS, index.postings.blocks);
+  putArray(SECTION_POSTING_TERMS, index.postings.terms);
+  putArray(SECTION_POSITION_DATA, index.postings.positions);
+  putArray(SECTION_POSITION_BLOCKS, index.postings.positionBlocks);
+  putArray(SECTION_IMPACT_DATA, index.impacts.data);
+  putArray(SECTION_IMPACT_RUNS, index.impacts.runs);
+  putArray(SECTION_IMPACT_TERMS, index.impacts.terms);
+  putArray(SECTION_DOC_NORMS, docs.norms);
+  putArray(SECTION_DOC_ROWIDS, docs.rowids);
+  putArray(SECTION_DOC_OFFSETS, docs.offsets);
+  putArray(SECTION_DOC_TEXT, docs.text);
+
+  SnapshotHeader header{{}, SNAPSHOT_VERSION, SECTION_COUNT,
+                        Checksum(table, sizeof(table))};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  out.seekp(0);
+  out.write((char const*)&header, sizeof(header));
+  out.write((char const*)table, sizeof(table));
+  out.close();
+  if (!out || std::rename(tmp.c_str(), path.c_str()))
+    throw std::runtime_error("cannot write " + path);
+}
+
+// Maps the snapshot at `path` into `index` and `docs` without reading it:
+// only the header and section table are checked up front, and the arrays
+// point straight into the mapping. With `verify`, every section's checksum
+// is checked too, which touches the whole file.
+inline void ReadSnapshot(std::string const& path, InvertedIndex& index,
+                         DocTable& docs, bool verify = false) {
+  auto file = MapFile(path);
+  auto fail = [&](char const* what) {
+    throw std::runtime_error(path + ": " + what);
+  };
+  SnapshotHeader header;
+  SnapshotEntry table[SECTION_COUNT];
+  if (file->size < sizeof(header) + sizeof(table)) fail("truncated");
+  memcpy(&header, file->data, sizeof(header));
+  memcpy(table, file->data + sizeof(header), sizeof(table));
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)))
+    fail("not a snapshot");
+  if (header.version != SNAPSHOT_VERSION) fail("unsupported version");
+  if (header.sections != SECTION_COUNT ||
+      header.checksum != Checksum(table, sizeof(table)))
+    fail("corrupt section table");
+  for (auto const& e : table) {
+    if (e.offset % SNAPSHOT_ALIGN || e.offset > file->size ||
+        e.size > file->size - e.offset)
+      fail("section out of bounds");
+    if (verify && e.checksum != Checksum(file->data + e.offset, e.size))
+      fail("checksum mismatch");
+  }
+
+  auto get = [&](SnapshotSection s, auto* type) {
+    using T = std::remove_const_t<std::remove_pointer_t<decltype(type)>>;
+    auto const& e = table[s];
+    return Array<T>((T const*)(file->data + e.offset), e.size / sizeof(T),
+                    file);
+  };
+  auto meta = get(SECTION_META, (SnapshotMeta*)nullptr);
+  if (meta.size() != 1) fail("missing meta");
+
+  index.dict.size = meta[0].terms;
+  index.dict.trieNodes = meta[0].trieNodes;
+  index.bm25.avgLength = meta[0].avgLength;
+  index.dict.data = get(SECTION_DICT_DATA, (uint8_t*)nullptr);
+  index.dict.blocks = get(SECTION_DICT_BLOCKS, (uint32_t*)nullptr);
+  index.postings.data = get(SECTION_POSTING_DATA, (uint8_t*)nullptr);
+  index.postings.blocks =
+      get(SECTION_POSTING_BLOCKS, (PostingStore::Block*)nullptr);
+  index.postings.terms =
+      get(SECTION_POSTING_TERMS, (PostingStore::Term*)nullptr);
+  index.postings.positions = get(SECTION_POSITION_DATA, (uint8_t*)nullptr);
+  index.postings.positionBlocks =
+      get(SECTION_POSITION_BLOCKS, (uint64_t*)nullptr);
+  index.impacts.data = get(SECTION_IMPACT_DATA, (uint8_t*)nullptr);
+  index.impacts.runs = get(SECTION_IMPACT_RUNS, (ImpactStore::Run*)nullptr);
+  index.impacts.terms = get(SECTION_IMPACT_TERMS, (uint32_t*)nullptr);
+  docs = {};
+  docs.norms = get(SECTION_DOC_NORMS, (double*)nullptr);
+  docs.rowids = get(SECTION_DOC_ROWIDS, (int64_t*)nullptr);
+  docs.offsets = get(SECTION_DOC_OFFSETS, (uint64_t*)nullptr);
+  docs.text = get(SECTION_DOC_TEXT, (char*)nullptr);
+  if (docs.norms.size() != meta[0].docs ||
+      docs.offsets.size() != meta[0].docs + 1 ||
+      index.postings.terms.size() != meta[0].terms ||
+      index.postings.positionBlocks.size() != index.postings.blocks.size() ||
+      index.impacts.terms.size() != meta[0].terms + 1 ||
+      index.impacts.terms[meta[0].terms] != index.impacts.runs.size())
+    fail("inconsistent sections");
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+const size_t SNIPPET_LENGTH = 240;  // bytes, about 80 CJK characters
+const size_t SNIPPET_FRAGMENTS = 2;
+const char* const SNIPPET_ELLIPSIS = "…";
+
+// A few windows of a document around its query-term hits, joined by
+// ellipses, with the hits to highlight as byte ranges into `text`.
+struct Snippet {
+  std::string text;
+  std::vector<std::pair<size_t, size_t>> highlights;  // [begin, end)
+};
+
+namespace snippet {
+
+struct Match {
+  size_t begin, end, term;
+};
+
+inline size_t CharStart(std::string_view s, size_t i) {
+  while (i > 0 && i < s.size() && (s[i] & 0xC0) == 0x80) --i;
+  return i;
+}
+
+// Occurrences of the keywords in the content, in order; where two overlap
+// the earlier, then longer one wins.
+template <class Keywords>
+std::vector<Match> FindMatches(std::string_view content, Keywords const& kws) {
+  std::vector<Match> all;
+  for (size_t t = 0; t < kws.size(); ++t) {
+    std::string_view word = kws[t].word;
+    if (word.empty()) continue;
+    for (size_t i = content.find(word); i != std::string_view::npos;
+         i = content.find(word, i + word.size()))
+      all.push_back({i, i + word.size(), t});
+  }
+  std::sort(all.begin(), all.end(), [](Match const& a, Match const& b) {
+    return a.begin != b.begin ? a.begin < b.begin : a.end > b.end;
+  });
+  std::vector<Match> matches;
+  for (auto const& m : all)
+    if (matches.empty() || m.begin >= matches.back().end) matches.push_back(m);
+  return matches;
+}
+
+}  // namespace snippet
+
+// Picks up to SNIPPET_FRAGMENTS non-overlapping windows of `length` bytes
+// scoring highest by the total weight of the distinct keywords they hold,
+// more hits breaking ties. Without hits, the start of the document.
+template <class Keywords>
+Snippet MakeSnippet(std::string_view content, Keywords const& kws,
+                    size_t length = SNIPPET_LENGTH) {
+  using snippet::CharStart;
+  auto matches = snippet::FindMatches(content, kws);
+  std::vector<std::pair<size_t, size_t>> windows;  // [first, last) matches
+  std::vector<bool> used(matches.size());
+  for (size_t f = 0; f < SNIPPET_FRAGMENTS; ++f) {
+    double bestScore = 0;
+    size_t bestHits = 0;
+    std::pair<size_t, size_t> best;
+    std::vector<size_t> count(kws.size());
+    double score = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < matches.size(); ++i) {
+      if (j < i) j = i;
+      while (j < matches.size() && !used[j] &&
+             matches[j].end <= matches[i].begin + length) {
+        if (!count[matches[j].term]++) score += kws[matches[j].term].weight;
+        ++j;
+      }
+      if (!used[i] &&
+          (score > bestScore || (score == bestScore && j - i > bestHits))) {
+        bestScore = score;
+        bestHits = j - i;
+        best = {i, j};
+      }
+      if (j > i && !--count[matches[i].term])
+        score -= kws[matches[i].term].weight;
+    }
+    if (!bestHits) break;
+    windows.push_back(best);
+    for (size_t i = best.first; i < best.second; ++i) used[i] = true;
+  }
+  std::sort(windows.begin(), windows.end());
+
+  // Center each window's hits in `length` bytes, within the document,
+  // and join windows that end up touching.
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (auto [first, last] : windows) {
+    size_t span = matches[last - 1].end - matches[first].begin;
+    size_t lead = (length - std::min(length, span)) / 2;
+    size_t begin = matches[first].begin - std::min(lead, matches[first].begin);
+    begin = std::min(begin, content.size() - std::min(length, content.size()));
+    begin = CharStart(content, begin);
+    size_t end = CharStart(content, std::min(begin + length, content.size()));
+    end = std::max(end, matches[last - 1].end);
+    if (!ranges.empty() && begin <= ranges.back().second)
+      ranges.back().second = std::max(ranges.back().second, end);
+    else
+      ranges.push_back({begin, end});
+  }
+  if (ranges.empty())
+    ranges.push_back({0, CharStart(content, std::min(length, content.size()))});
+
+  Snippet s;
+  size_t at = 0, m = 0;
+  for (auto [begin, end] : ranges) {
+    if (begin > at) s.text += SNIPPET_ELLIPSIS;
+    size_t base = s.text.size();
+    s.text.append(content.substr(begin, end - begin));
+    for (; m < matches.size() && matches[m].begin < end; ++m)
+      if (matches[m].begin >= begin && matches[m].end <= end)
+        s.highlights.push_back(
+            {base + matches[m].begin - begin, base + matches[m].end - begin});
+    at = end;
+  }
+  if (at < content.size()) s.text += SNIPPET_ELLIPSIS;
+  return s;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Read-only view over a typed array that either owns its elements or
+// points into a mapped file. Copies share the backing memory.
+template <class T>
+struct Array {
+  T const* ptr = nullptr;
+  size_t n = 0;
+  std::shared_ptr<void const> owner;
+
+  Array() = default;
+  Array(std::vector<T> v) {
+    auto p = std::make_shared<std::vector<T> const>(std::move(v));
+    ptr = p->data();
+    n = p->size();
+    owner = std::move(p);
+  }
+  Array(T const* ptr, size_t n, std::shared_ptr<void const> owner)
+      : ptr(ptr), n(n), owner(std::move(owner)) {}
+
+  T const& operator[](size_t i) const { return ptr[i]; }
+  T const* data() const { return ptr; }
+  T const* begin() const { return ptr; }
+  T const* end() const { return ptr + n; }
+  size_t size() const { return n; }
+  bool empty() const { return !n; }
+  size_t Bytes() const { return n * sizeof(T); }
+};
+
+struct MappedFile {
+  uint8_t const* data;
+  size_t size;
+};
+
+// Maps `path` read-only. Pages are faulted in on first touch; the mapping
+// lives until the last Array pointing into it is gone.
+inline std::shared_ptr<MappedFile const> MapFile(std::string const& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("cannot open " + path);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw std::runtime_error("cannot stat " + path);
+  }
+  size_t size = st.st_size;
+  void* p = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+  close(fd);
+  if (p == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+  auto unmap = [](MappedFile const* m) {
+    if (m->size) munmap((void*)m->data, m->size);
+    delete m;
+  };
+  return std::shared_ptr<MappedFile const>(
+      new MappedFile{(uint8_t const*)p, size}, unmap);
+}
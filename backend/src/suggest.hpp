@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+const size_t SUGGEST_TOP = 10;
+// Prefixes matching at most this many terms are answered by scanning them.
+const size_t SUGGEST_SCAN = 256;
+
+// Prefix completion over the terms of the index, best first by document
+// frequency. The terms with a given prefix are a contiguous range of the
+// sorted term list; prefixes whose range is longer than SUGGEST_SCAN have
+// their SUGGEST_TOP best terms cached, and shorter ranges are scanned, so
+// a lookup never looks at more than SUGGEST_SCAN terms. Prefixes are
+// matched bytewise, so one ending inside a UTF-8 character completes to
+// the terms whose next character starts with those bytes.
+struct Suggester {
+  struct Suggestion {
+    std::string_view term;
+    uint32_t df;
+  };
+
+  std::vector<std::string> terms;  // sorted
+  std::vector<uint32_t> df;
+  std::unordered_map<std::string, std::vector<uint32_t>> top;
+
+  // `counts` maps every term to its document frequency.
+  explicit Suggester(std::unordered_map<std::string, uint32_t> counts) {
+    std::vector<std::pair<std::string, uint32_t>> sorted(
+        std::make_move_iterator(counts.begin()),
+        std::make_move_iterator(counts.end()));
+    std::sort(sorted.begin(), sorted.end());
+    for (auto& [term, n] : sorted) {
+      terms.push_back(std::move(term));
+      df.push_back(n);
+    }
+    Cache(0, terms.size(), 0);
+  }
+
+  std::vector<Suggestion> Complete(std::string_view prefix,
+                                   size_t n = SUGGEST_TOP) const {
+    n = std::min(n, SUGGEST_TOP);
+    auto [lo, hi] = Range(prefix, 0, terms.size());
+    std::vector<uint32_t> best;
+    auto it = top.find(std::string(prefix));
+    if (it != top.end()) {
+      best.assign(it->second.begin(),
+                  it->second.begin() + std::min(n, it->second.size()));
+    } else {
+      for (size_t i = lo; i < hi; ++i) best.push_back(i);
+      Best(best, n);
+    }
+    std::vector<Suggestion> out;
+    for (auto i : best) out.push_back({terms[i], df[i]});
+    return out;
+  }
+
+  size_t MemoryUsage() const {
+    size_t n = sizeof(*this) + df.size() * sizeof(uint32_t);
+    for (auto const& t : terms) n += sizeof(t) + t.size();
+    for (auto const& [p, ids] : top)
+      n += p.size() + ids.size() * sizeof(uint32_t) + sizeof(p) + sizeof(ids);
+    return n;
+  }
+
+ private:
+  // Terms in [lo, hi) that start with `prefix`.
+  std::pair<size_t, size_t> Range(std::string_view prefix, size_t lo,
+                                   size_t hi) const {
+    auto first = std::lower_bound(
+        terms.begin() + lo, terms.begin() + hi, prefix,
+        [](std::string const& t, std::string_view p) { return t < p; });
+    auto last = std::partition_point(first, terms.begin() + hi,
+                                     [&](std::string const& t) {
+                                       return t.compare(0, prefix.size(),
+                                                        prefix) == 0;
+                                     });
+    return {first - terms.begin(), last - terms.begin()};
+  }
+
+  // Keeps the n best of `ids`, best first: higher df, then earlier term.
+  void Best(std::vector<uint32_t>& ids, size_t n) const {
+    n = std::min(n, ids.size());
+    std::partial_sort(ids.begin(), ids.begin() + n, ids.end(),
+                      [&](uint32_t a, uint32_t b) {
+                        return df[a] > df[b] || (df[a] == df[b] && a < b);
+                      });
+    ids.resize(n);
+  }
+
+  // Caches the best terms of [lo, hi), which share their first `depth`
+  // bytes, if it is too long to scan, then does the same for each group
+  // sharing one more byte.
+  void Cache(size_t lo, size_t hi, size_t depth) {
+    if (hi - lo <= SUGGEST_SCAN) return;
+    std::vector<uint32_t> ids;
+    for (size_t i = lo; i < hi; ++i) ids.push_back(i);
+    Best(ids, SUGGEST_TOP);
+    top.emplace(terms[lo].substr(0, depth), std::move(ids));
+    if (terms[lo].size() == depth) ++lo;
+    while (lo < hi) {
+      size_t end = Range(std::string_view(terms[lo]).substr(0, depth + 1), lo,
+                         hi).second;
+      Cache(lo, end, depth + 1);
+      lo = end;
+    }
+  }
+};
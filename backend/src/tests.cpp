@@ -0,0 +1,283 @@
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+
+#include "cluster.hpp"
+#include "corpus.hpp"
+
+// Differential tests of the ranking paths against exhaustive evaluation,
+// and round trips through the snapshot and the shard protocol, over a
+// corpus generated from a dictionary of TEST_WORDS made-up words. The
+// dictionary is written under PETAL_TEST_DIR, which the tests run in, so
+// they need neither the full jieba dictionary nor db.db.
+//   tests [substring]   run the tests whose names contain it
+const size_t TEST_WORDS = 3000;
+const size_t TEST_DOCS = 2000;
+const size_t TEST_PENDING = SEAL_DOCS + SEAL_DOCS / 2;
+const size_t TEST_QUERIES = 200;
+const size_t TEST_K = 10;
+const double TEST_EPSILON = 1e-9;
+
+std::string filter;
+int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+              #cond);                                                 \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (0)
+
+template <class F>
+void Test(char const* name, F&& f) {
+  if (std::string_view(name).find(filter) == std::string_view::npos) return;
+  int before = failures;
+  f();
+  printf("%-32s %s\n", name, failures == before ? "ok" : "FAILED");
+  fflush(stdout);
+}
+
+// Word r is two characters, the first from one block of CJK ideographs
+// and the second from another, so no two neighbouring words make up a
+// third. Its frequency falls with r as in the corpus.
+void WriteDictionary() {
+  std::filesystem::path dir = DICT_PATH;
+  dir = dir.parent_path();
+  std::filesystem::create_directories(dir);
+  for (auto name : {"hmm_model.utf8", "user.dict.utf8", "stop_words.utf8"})
+    std::filesystem::copy_file(
+        std::filesystem::path(PETAL_DICT_DIR) / name, dir / name,
+        std::filesystem::copy_options::overwrite_existing);
+  auto utf8 = [](std::string& s, uint32_t c) {
+    s += (char)(0xE0 | c >> 12);
+    s += (char)(0x80 | (c >> 6 & 0x3F));
+    s += (char)(0x80 | (c & 0x3F));
+  };
+  std::ofstream dict(DICT_PATH), idf(IDF_PATH);
+  for (size_t r = 0; r < TEST_WORDS; ++r) {
+    std::string word;
+    utf8(word, 0x4E00 + r % 97);
+    utf8(word, 0x6000 + r / 97);
+    dict << word << ' ' << 1000000 / (r + 1) << " n\n";
+    idf << word << ' ' << std::log(10.0 * (r + 1)) << '\n';
+  }
+}
+
+// Engine over the first TEST_DOCS docs of the corpus as its base index,
+// with TEST_PENDING more added one at a time, so searches see a sealed
+// segment and pending docs too, and every 50th doc deleted.
+struct Fixture {
+  Corpus corpus{LoadDictWords()};
+  std::unique_ptr<Engine> db;
+
+  Fixture() {
+    Jieba jb;
+    InvertedIndex index;
+    DocTable docs;
+    BuildIndex(index, docs, [&](auto&& add) {
+      for (size_t i = 0; i < TEST_DOCS; ++i) {
+        auto [art, terms] = Doc(jb, i);
+        add(std::move(art), std::move(terms));
+      }
+    });
+    db = std::make_unique<Engine>(std::move(index), std::move(docs));
+    db->fuzzy = false;
+    db->shards = 4;
+    for (size_t i = TEST_DOCS; i < TEST_DOCS + TEST_PENDING; ++i) {
+      auto [art, terms] = Doc(jb, i);
+      double w = art.w;
+      db->Index(std::move(art), {0, w, std::move(terms)});
+    }
+    for (size_t i = 0; i < db->docs.size(); i += 50) db->Delete(i);
+  }
+
+  std::pair<DocTable::Article, std::vector<MemTerm>> Doc(Jieba const& jb,
+                                                         size_t i) {
+    auto text = corpus.Doc(i);
+    auto kws = jb.Keywords(text);
+    ToCharPositions(text, kws);
+    double w = sqrt(Engine::GetNorm(kws));
+    return {{std::move(text), w, (int64_t)i + 1}, ToTerms(kws)};
+  }
+
+  AnalyzedQuery Query(size_t i) {
+    return AnalyzeQuery(db->jb, corpus.Query(i, 1 + i % 4));
+  }
+};
+
+bool Near(double a, double b) {
+  return std::abs(a - b) <= TEST_EPSILON * std::max(1.0, std::abs(b));
+}
+
+// `got` must have the scores of the exhaustive top-k, in order, and each
+// of its docs the score exhaustive evaluation gives it; docs may differ
+// only where scores tie.
+void CheckAgainstExhaustive(Engine& db, AnalyzedQuery const& q,
+                            Engine::Scoring scoring,
+                            std::vector<Hit> const& got) {
+  auto want = db.Rank(q, TEST_K, Engine::Mode::EXHAUSTIVE, scoring);
+  std::map<ArticleID, double> all;
+  for (auto hit :
+       db.Rank(q, db.docs.size(), Engine::Mode::EXHAUSTIVE, scoring))
+    all[hit.id] = hit.score;
+  CHECK(got.size() == want.size());
+  for (size_t j = 0; j < std::min(got.size(), want.size()); ++j) {
+    CHECK(Near(got[j].score, want[j].score));
+    CHECK(all.count(got[j].id) && Near(got[j].score, all[got[j].id]));
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) filter = argv[1];
+  std::filesystem::create_directories(PETAL_TEST_DIR);
+  std::filesystem::current_path(PETAL_TEST_DIR);
+  WriteDictionary();
+  Fixture f;
+  auto& db = *f.db;
+
+  Test("wand_matches_exhaustive", [&] {
+    for (size_t i = 0; i < TEST_QUERIES; ++i) {
+      auto q = f.Query(i);
+      for (auto scoring : {Engine::Scoring::COSINE, Engine::Scoring::BM25})
+        CheckAgainstExhaustive(
+            db, q, scoring, db.Rank(q, TEST_K, Engine::Mode::WAND, scoring));
+    }
+  });
+
+  Test("anytime_unlimited_matches_exhaustive", [&] {
+    auto budget = db.anytime;
+    db.anytime = {SIZE_MAX, std::chrono::hours(1)};
+    for (size_t i = 0; i < TEST_QUERIES; ++i) {
+      auto q = f.Query(i);
+      CheckAgainstExhaustive(db, q, Engine::Scoring::BM25,
+                             db.Rank(q, TEST_K, Engine::Mode::ANYTIME,
+                                     Engine::Scoring::BM25));
+    }
+    db.anytime = budget;
+  });
+
+  Test("anytime_rejects_cosine", [&] {
+    bool threw = false;
+    try {
+      db.Rank(f.Query(0), TEST_K, Engine::Mode::ANYTIME,
+              Engine::Scoring::COSINE);
+    } catch (std::invalid_argument const&) {
+      threw = true;
+    }
+    CHECK(threw);
+  });
+
+  Test("snapshot_round_trip", [&] {
+    Jieba jb;
+    InvertedIndex index, read;
+    DocTable docs, readDocs;
+    BuildIndex(index, docs, [&](auto&& add) {
+      for (size_t i = 0; i < TEST_DOCS; ++i) {
+        auto [art, terms] = f.Doc(jb, i);
+        add(std::move(art), std::move(terms));
+      }
+    });
+    WriteSnapshot("test.petal", index, docs);
+    ReadSnapshot("test.petal", read, readDocs, true);
+    auto same = [](auto const& a, auto const& b) {
+      return a.Bytes() == b.Bytes() && !memcmp(a.data(), b.data(), a.Bytes());
+    };
+    CHECK(read.dict.size == index.dict.size);
+    CHECK(read.dict.trieNodes == index.dict.trieNodes);
+    CHECK(read.bm25.avgLength == index.bm25.avgLength);
+    CHECK(same(read.dict.data, index.dict.data));
+    CHECK(same(read.dict.blocks, index.dict.blocks));
+    CHECK(same(read.postings.data, index.postings.data));
+    CHECK(same(read.postings.blocks, index.postings.blocks));
+    CHECK(same(read.postings.terms, index.postings.terms));
+    CHECK(same(read.postings.positions, index.postings.positions));
+    CHECK(same(read.postings.positionBlocks, index.postings.positionBlocks));
+    CHECK(same(read.impacts.data, index.impacts.data));
+    CHECK(same(read.impacts.runs, index.impacts.runs));
+    CHECK(same(read.impacts.terms, index.impacts.terms));
+    CHECK(readDocs.size() == docs.size());
+    for (size_t i = 0; i < docs.size(); ++i) {
+      CHECK(readDocs.Content(i) == docs.Content(i));
+      CHECK(readDocs.Norm(i) == docs.Norm(i));
+      CHECK(readDocs.RowID(i) == docs.RowID(i));
+    }
+    for (auto const& word : f.corpus.words)
+      CHECK(read.dict.Find(word) == index.dict.Find(word));
+    std::filesystem::remove("test.petal");
+  });
+
+  Test("shard_query_round_trip", [&] {
+    auto words = [&](size_t i) { return f.corpus.words[i]; };
+    auto q = AnalyzeQuery(db.jb, words(3) + words(8) + " \"" + words(1) +
+                                     words(2) + "\" +" + words(5) + " -" +
+                                     words(40));
+    CHECK(!q.phrases.empty() && !q.required.empty() && !q.excluded.empty());
+    auto body = EncodeShardQuery(q, Engine::Mode::WAND, Engine::Scoring::BM25,
+                                 SNIPPET_LENGTH);
+    AnalyzedQuery got;
+    Engine::Mode mode;
+    Engine::Scoring scoring;
+    size_t snippetLength;
+    DecodeShardQuery(body, got, mode, scoring, snippetLength);
+    CHECK(mode == Engine::Mode::WAND);
+    CHECK(scoring == Engine::Scoring::BM25);
+    CHECK(snippetLength == SNIPPET_LENGTH);
+    CHECK(got.kws.size() == q.kws.size());
+    for (size_t i = 0; i < std::min(got.kws.size(), q.kws.size()); ++i) {
+      CHECK(got.kws[i].word == q.kws[i].word);
+      CHECK(got.kws[i].weight == q.kws[i].weight);
+      CHECK(Engine::QueryCount(got.kws[i]) == Engine::QueryCount(q.kws[i]));
+    }
+    CHECK(got.phrases.size() == q.phrases.size());
+    for (size_t i = 0; i < std::min(got.phrases.size(), q.phrases.size());
+         ++i) {
+      CHECK(got.phrases[i].words == q.phrases[i].words);
+      CHECK(got.phrases[i].slots == q.phrases[i].slots);
+      CHECK(got.phrases[i].lengths == q.phrases[i].lengths);
+      CHECK(got.phrases[i].length == q.phrases[i].length);
+      CHECK(got.phrases[i].slop == q.phrases[i].slop);
+    }
+    CHECK(got.required == q.required);
+    CHECK(got.excluded == q.excluded);
+
+    bool threw = false;
+    try {
+      DecodeShardQuery(body.substr(0, body.size() - 1), got, mode, scoring,
+                       snippetLength);
+    } catch (std::runtime_error const&) {
+      threw = true;
+    }
+    CHECK(threw);
+  });
+
+  Test("shard_hits_round_trip", [&] {
+    for (size_t snippetLength : {(size_t)0, SNIPPET_LENGTH})
+      for (size_t i = 0; i < TEST_QUERIES; i += 20) {
+        auto q = f.Query(i);
+        auto want = db.Hits(q, Engine::Mode::WAND, Engine::Scoring::COSINE);
+        auto got = DecodeShardHits(ServeShardQuery(
+            db, EncodeShardQuery(q, Engine::Mode::WAND,
+                                 Engine::Scoring::COSINE, snippetLength)));
+        CHECK(got.size() == want.size());
+        for (size_t j = 0; j < std::min(got.size(), want.size()); ++j) {
+          CHECK(got[j].hit.id == want[j].id);
+          CHECK(got[j].hit.score == want[j].score);
+          if (!snippetLength) {
+            CHECK(got[j].text == db.docs.Content(want[j].id));
+            CHECK(got[j].highlights.empty());
+            continue;
+          }
+          auto snippet =
+              MakeSnippet(db.docs.Content(want[j].id), q.kws, snippetLength);
+          CHECK(got[j].text == snippet.text);
+          CHECK(got[j].highlights.size() == snippet.highlights.size());
+        }
+      }
+  });
+
+  return failures ? 1 : 0;
+}